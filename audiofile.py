@@ -0,0 +1,181 @@
+"""
+This module reads audio from WAV or raw PCM files, which are memory-mapped,
+or from streams such as stdin. Audio is read in large blocks, converted to
+single floats, for processing faster than real time (see the offline mode
+of led-meter).
+"""
+
+import sys
+import mmap
+import struct
+import numpy as np
+
+block_size = 1 << 16
+
+# Raw sample formats: numpy type and the scale to convert to [-1, 1]
+raw_formats = {
+    "s16": ("<i2", 1 / 32768.0),
+    "s32": ("<i4", 1 / 2147483648.0),
+    "f32": ("<f4", 1.0),
+}
+
+# WAV format tags
+wave_format_pcm = 1
+wave_format_float = 3
+wave_format_extensible = 0xFFFE
+
+class AudioInput:
+    """
+    Reads interleaved audio from a file or stream.
+    """
+
+    def __init__(self, path, raw_format=None, raw_rate=48000, raw_channels=1):
+        """
+        Open `path` ("-" for stdin). If `raw_format` is None, the input is
+        expected to be a WAV file. Otherwise it's raw PCM in that format
+        (a key of `raw_formats`), with `raw_rate` and `raw_channels`.
+
+        Regular files are memory-mapped, streams are read block by block.
+        """
+        self.stream = sys.stdin if path == "-" else open(path, "rb")
+        self.position = 0
+        self.header_length = 0
+
+        if raw_format is None:
+            self.read_wave_header()
+        else:
+            if raw_format not in raw_formats:
+                raise Exception("unknown raw format %s" % raw_format)
+            self.dtype, self.scale = raw_formats[raw_format]
+            self.sample_rate, self.channels = int(raw_rate), int(raw_channels)
+            self.data_length = None
+        self.frame_size = np.dtype(self.dtype).itemsize * self.channels
+
+        # Map the samples, if the input is a regular file
+        self.samples = None
+        try:
+            self.stream.seek(0, 2)
+            end = self.stream.tell()
+        except IOError:
+            return
+        length = end - self.header_length
+        if self.data_length is not None:
+            length = min(length, self.data_length)
+        if length < self.frame_size:
+            self.samples = np.zeros((0, self.channels), self.dtype)
+            return
+        self.map = mmap.mmap(self.stream.fileno(), 0, access=mmap.ACCESS_READ)
+        self.samples = np.frombuffer(self.map, self.dtype, (length // self.frame_size) * self.channels,
+            self.header_length).reshape(-1, self.channels)
+
+    def read_wave_header(self):
+        """
+        Parse the WAV header, up to the start of the samples.
+        """
+        read = self.stream.read
+        riff = read(12)
+        if len(riff) < 12 or riff[0:4] != "RIFF" or riff[8:12] != "WAVE":
+            raise Exception("input isn't a WAV file")
+        self.header_length = 12
+        format = None
+        while True:
+            header = read(8)
+            if len(header) < 8:
+                raise Exception("no data in WAV file")
+            name, length = struct.unpack("<4sI", header)
+            self.header_length += 8
+            if name == "data":
+                break
+            chunk = read(length + (length & 1))
+            self.header_length += len(chunk)
+            if name == "fmt ":
+                format = chunk
+        if format is None or len(format) < 16:
+            raise Exception("no format in WAV file")
+
+        tag, self.channels, self.sample_rate, _, _, bits = struct.unpack("<HHIIHH", format[:16])
+        if tag == wave_format_extensible and len(format) >= 26:
+            tag = struct.unpack("<H", format[24:26])[0]
+        if tag == wave_format_pcm and bits == 16:
+            self.dtype, self.scale = raw_formats["s16"]
+        elif tag == wave_format_pcm and bits == 32:
+            self.dtype, self.scale = raw_formats["s32"]
+        elif tag == wave_format_float and bits == 32:
+            self.dtype, self.scale = raw_formats["f32"]
+        else:
+            raise Exception("unsupported WAV format (%d, %d bits)" % (tag, bits))
+
+        # Streamed WAVs may not know their length
+        self.data_length = length if length not in (0, 0xFFFFFFFF) else None
+
+    def read_chunk(self, length):
+        """
+        Return (without converting them) the next `length` frames, or less
+        at the end of the input, as an array of frames x channels.
+        """
+        if self.samples is not None:
+            return self.samples[self.position:self.position+length]
+        wanted = length * self.frame_size
+        if self.data_length is not None:
+            wanted = min(wanted, self.data_length - self.position * self.frame_size)
+        data = self.read_fully(wanted)
+        length = len(data) // self.frame_size
+        return np.frombuffer(data, self.dtype, length * self.channels).reshape(-1, self.channels)
+
+    def read_into(self, buffer, channel=0):
+        """
+        Read the next frames of `channel` into `buffer` (an array of single
+        floats), converting them. Returns how many frames were read, which
+        is only less than the buffer length at the end of the input.
+        """
+        chunk = self.read_chunk(len(buffer))[:, channel]
+        length = len(chunk)
+        np.multiply(chunk, self.scale, out=buffer[:length], casting="unsafe")
+        self.position += length
+        return length
+
+    def read_channels_into(self, buffers):
+        """
+        Same as `read_into()`, but reads every channel, into the
+        rows of `buffers` (a 2D array of channels x frames).
+        """
+        chunk = self.read_chunk(buffers.shape[1])
+        length = len(chunk)
+        for channel in xrange(self.channels):
+            np.multiply(chunk[:, channel], self.scale, out=buffers[channel, :length], casting="unsafe")
+        self.position += length
+        return length
+
+    def read_all(self, channel=0):
+        """
+        Read the rest of `channel` at once. Returns an array of single floats.
+        """
+        if self.samples is not None:
+            buffer = np.empty(len(self.samples) - self.position, 'f')
+            self.read_into(buffer, channel)
+            return buffer
+        blocks = []
+        while True:
+            buffer = np.empty(block_size, 'f')
+            length = self.read_into(buffer, channel)
+            if not length: break
+            blocks.append(buffer[:length])
+        return np.concatenate(blocks) if blocks else np.empty(0, 'f')
+
+    def read_fully(self, length):
+        """
+        Read `length` bytes from the stream, unless it ends first.
+        """
+        data = []
+        while length > 0:
+            chunk = self.stream.read(length)
+            if not chunk: break
+            data.append(chunk)
+            length -= len(chunk)
+        return "".join(data)
+
+    def get_duration(self):
+        """
+        Return the duration, in seconds, of the audio read so far.
+        """
+        return self.position / float(self.sample_rate)
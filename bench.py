@@ -0,0 +1,275 @@
+#!/usr/bin/python
+"""
+This module benchmarks the pieces of led-meter that run for every
+sample or frame: the filter chain and the loudness filter (both the
+Python and the native implementations, checking that they give the
+same output), the LED mapping, and the building of LEDP packets.
+"""
+
+import imp
+import os
+import math
+import array
+import random
+import socket
+import struct
+import timeit
+
+import filters
+import ledp
+from filters import VolumeFollowFilter, NativeVolumeFollowFilter, AttackReleaseFilter
+from filters import LoudnessFilter, NativeLoudnessFilter
+
+led_meter = imp.load_source("led_meter", os.path.join(os.path.dirname(os.path.abspath(__file__)), "led-meter.py"))
+
+sample_rates = [48000, 96000, 192000]
+
+
+# Input audio
+
+def synthetic_audio(sample_rate, duration, seed=0):
+    """
+    Generate `duration` seconds of deterministic test audio: a sine sweep
+    with noise bursts and silences, to exercise both the attack and the
+    release of the filters. Returns an array of single floats.
+    """
+    rng = random.Random(seed)
+    samples = array.array("f", [0.0] * int(sample_rate * duration))
+    phase = 0.0
+    for i in xrange(len(samples)):
+        t = float(i) / sample_rate
+        frequency = 40 * 2 ** (t % 8)
+        phase += 2 * math.pi * frequency / sample_rate
+        envelope = 0.8 if (t % 1) < 0.6 else 0.05
+        noise = rng.uniform(-0.3, 0.3) if (t % 2) < 0.1 else 0
+        samples[i] = envelope * math.sin(phase) + noise
+    return samples
+
+def read_wav(path):
+    """
+    Read the first channel of a PCM WAV file. Returns the samples (as an
+    array of single floats) and the sample rate.
+    """
+    import wave
+    wav = wave.open(path, "rb")
+    channels, width, rate, frames = wav.getparams()[:4]
+    data = wav.readframes(frames)
+    wav.close()
+
+    formats = {1: ("B", 128, 128.0), 2: ("h", 0, 32768.0), 4: ("i", 0, 2147483648.0)}
+    if width not in formats:
+        raise Exception("unsupported sample width: %d bytes" % width)
+    code, offset, scale = formats[width]
+    values = array.array(code, data)[::channels]
+    return array.array("f", [(value - offset) / scale for value in values]), rate
+
+
+# Benchmarks
+
+def create_filter(filter_class, sample_rate):
+    """
+    Create a volume filter with the default led-meter options.
+    """
+    frames = lambda time: float(time) * sample_rate
+    return filter_class(
+        frames(1 / 30.0),
+        frames(1 / 1.5), 0.72,
+        AttackReleaseFilter.get_coefficient(frames(0.002)),
+        AttackReleaseFilter.get_coefficient(frames(0.070))
+    )
+
+def measure(function, repeat=3):
+    """
+    Call `function` `repeat` times, returning the best time in seconds.
+    """
+    best = None
+    for i in xrange(repeat):
+        start = timeit.default_timer()
+        function()
+        elapsed = timeit.default_timer() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+def run_chain(filter, samples, buffer_size, output):
+    """
+    Process `samples` with `filter`, one buffer at a time like led-meter
+    does, storing the output. Buffers are preallocated.
+    """
+    input = array.array("f", [0.0] * buffer_size)
+    block = array.array("d", [0.0] * buffer_size)
+    for start in xrange(0, len(samples) - buffer_size + 1, buffer_size):
+        input[:] = samples[start:start+buffer_size]
+        filter.process_buffer(input, block)
+        output[start:start+buffer_size] = block
+
+def report_chain(name, seconds, samples, meters=1):
+    """
+    Print the cost of processing `samples` for `meters` meters.
+    """
+    ns = seconds * 1e9 / (samples * meters)
+    per_core = "  ".join("%dkHz: %7.1f" % (rate / 1000, 1e9 / (ns * rate)) for rate in sample_rates)
+    print "  %-22s %9.1f ns/sample   meters per core  %s" % (name, ns, per_core)
+
+def bench_chain(samples, sample_rate, buffer_size, meters, repeat):
+    """
+    Benchmark the filter chain, and check the equivalence
+    of the Python and native implementations.
+    """
+    length = len(samples) - len(samples) % buffer_size
+    print "Filter chain (%d samples, buffers of %d):" % (length, buffer_size)
+
+    python_output = array.array("d", [0.0] * length)
+    seconds = measure(lambda: run_chain(create_filter(VolumeFollowFilter, sample_rate),
+                                        samples, buffer_size, python_output), repeat)
+    report_chain("python", seconds, length)
+
+    if filters.engine is None:
+        print "  (native engine not compiled, skipping)"
+        return
+
+    native_output = array.array("d", [0.0] * length)
+    seconds = measure(lambda: run_chain(create_filter(NativeVolumeFollowFilter, sample_rate),
+                                        samples, buffer_size, native_output), repeat)
+    report_chain("native", seconds, length)
+
+    difference = max(abs(a - b) for a, b in zip(python_output, native_output))
+    print "  python vs native: %s" % ("identical" if difference == 0 else "max difference %g" % difference)
+
+    # The bank needs 2D arrays for the levels
+    try:
+        import numpy as np
+    except ImportError:
+        print "  (numpy not available, skipping bank)"
+        return
+    input = np.zeros(buffer_size, "f")
+    inputs = [input] * meters
+    interval = sample_rate // 60
+    levels = np.zeros((buffer_size // interval + 1, meters), "d")
+    def run_bank():
+        bank = filters.NativeVolumeFollowBank(
+            [create_filter(NativeVolumeFollowFilter, sample_rate) for i in xrange(meters)])
+        for start in xrange(0, length, buffer_size):
+            input[:] = samples[start:start+buffer_size]
+            bank.process_decimated(inputs, interval, levels)
+    seconds = measure(run_bank, repeat)
+    report_chain("native bank (%d)" % meters, seconds, length, meters)
+
+def run_loudness(filter, samples, buffer_size, interval, output):
+    """
+    Process `samples` with a loudness filter, one buffer at a time,
+    storing the levels. Buffers are preallocated.
+    """
+    input = array.array("f", [0.0] * buffer_size)
+    levels = array.array("d", [0.0] * (buffer_size // interval + 1))
+    frames = 0
+    for start in xrange(0, len(samples) - buffer_size + 1, buffer_size):
+        input[:] = samples[start:start+buffer_size]
+        count = filter.process_decimated(input, interval, levels)
+        output[frames:frames+count] = levels[:count]
+        frames += count
+
+def bench_loudness(samples, sample_rate, buffer_size, repeat):
+    """
+    Benchmark the rms and loudness engines, and check the equivalence
+    of the Python and native implementations.
+    """
+    length = len(samples) - len(samples) % buffer_size
+    interval = sample_rate // 60
+    window = sample_rate * 0.4
+    print "Loudness (%d samples, buffers of %d):" % (length, buffer_size)
+
+    for name, weighting in [("rms", None), ("loudness", sample_rate)]:
+        outputs = []
+        for implementation, filter_class in [("python", LoudnessFilter), ("native", NativeLoudnessFilter)]:
+            if filter_class is NativeLoudnessFilter and filters.engine is None:
+                print "  (native engine not compiled, skipping)"
+                break
+            output = array.array("d", [0.0] * (length // interval + 1))
+            seconds = measure(lambda: run_loudness(filter_class(window, interval, weighting),
+                                                   samples, buffer_size, interval, output), repeat)
+            report_chain("%s %s" % (implementation, name), seconds, length)
+            outputs.append(output)
+        if len(outputs) == 2:
+            difference = max(abs(a - b) for a, b in zip(*outputs))
+            print "  python vs native: %s" % ("identical" if difference == 0 else "max difference %g" % difference)
+
+def bench_mapping(repeat, calls=100000):
+    """
+    Benchmark the mapping of levels into LEDs.
+    """
+    print "LED mapping (%d calls):" % calls
+    rng = random.Random(1)
+    levels = [rng.uniform(0, 1) ** 4 for i in xrange(calls)]
+    options = {"range": (-18.0, -4.0), "count": 4, "should_round": False}
+    table_options = led_meter.prepare_map_options(dict(options))
+    to_decibel, map_to_leds = led_meter.to_decibel, led_meter.map_to_leds
+
+    def run_decibel():
+        for level in levels: to_decibel(level)
+    def run_map():
+        for level in levels: map_to_leds(level, options)
+    def run_table():
+        for level in levels: map_to_leds(level, table_options)
+    if any(map_to_leds(level, options) != map_to_leds(level, table_options) for level in levels):
+        print "  warning: the threshold table doesn't match map_to_leds"
+    for name, function in [("to_decibel", run_decibel), ("map_to_leds", run_map),
+                           ("map_to_leds (table)", run_table)]:
+        print "  %-22s %9.1f ns/call" % (name, measure(function, repeat) * 1e9 / calls)
+
+def bench_packets(repeat, calls=100000):
+    """
+    Benchmark the building of LEDP messages, with a null socket.
+    """
+    print "Packet building (%d commits):" % calls
+    class NullSocket:
+        family = socket.AF_INET
+        def sendto(self, packet, address): pass
+    client = ledp.Client(NullSocket(), "127.0.0.1")
+    leds = range(4)
+    counts = [i % 5 for i in xrange(calls)]
+
+    def run_pack():
+        for count in counts: struct.pack("!BII", ledp.protocol_version, 0xF, count)
+    def run_pack_into():
+        for count in counts: ledp.header_v1.pack_into(client.packet, 0, ledp.protocol_version, 0xF, count)
+    def run_commit():
+        for count in counts: led_meter.send_leds(client, leds, count)
+    for name, function in [("struct.pack", run_pack), ("Struct.pack_into", run_pack_into),
+                           ("set_leds + commit", run_commit)]:
+        print "  %-22s %9.1f ns/call" % (name, measure(function, repeat) * 1e9 / calls)
+
+
+
+if __name__ == "__main__":
+    __doc__ = """
+Benchmarks the led-meter filter chain, LED mapping and packet building.
+
+If a WAV file is given, its first channel is used as input, otherwise
+synthetic audio is generated.
+
+Usage:
+  bench.py [options] [<wav>]
+  bench.py (-h | --help)
+
+Options:
+  -d <s>, --duration <s>     Seconds of synthetic audio to use. [default: 5]
+  -b <n>, --buffer-size <n>  Buffer size, in samples. [default: 1024]
+  -m <n>, --meters <n>       Meters to run in the bank benchmark. [default: 8]
+  -r <n>, --repeat <n>       Repeat every benchmark this many times,
+                             keeping the best one. [default: 3]
+    """
+
+    from docopt import docopt
+    arguments = docopt(__doc__.strip())
+    repeat = int(arguments["--repeat"])
+
+    if arguments["<wav>"]:
+        samples, sample_rate = read_wav(arguments["<wav>"])
+    else:
+        sample_rate = 48000
+        samples = synthetic_audio(sample_rate, float(arguments["--duration"]))
+
+    bench_chain(samples, sample_rate, int(arguments["--buffer-size"]), int(arguments["--meters"]), repeat)
+    bench_loudness(samples, sample_rate, int(arguments["--buffer-size"]), repeat)
+    bench_mapping(repeat)
+    bench_packets(repeat)
@@ -0,0 +1,266 @@
+/**
+ * Vectorized version of `volume_follow_filter`: a bank runs many
+ * independent filters (meters or channels) side by side, packing them
+ * into the SIMD lanes of the machine. A single-pole IIR can't be
+ * vectorized along time, but it can across filters, since each lane
+ * does exactly the same arithmetic as the scalar filter in `filters.h`
+ * (and therefore gives identical output).
+ *
+ * This uses GCC vector extensions, so the same code compiles to
+ * SSE / AVX on x86 and NEON on ARM, or plain scalar code elsewhere.
+ **/
+
+#ifndef ENGINE_BANK_H
+#define ENGINE_BANK_H
+
+#include <stdint.h>
+#include <string.h>
+#include "filters.h"
+
+// Lanes per vector: 256-bit registers with AVX, otherwise
+// 128-bit ones (SSE2, NEON)
+#ifdef __AVX__
+#define VECTOR_LANES 4
+#else
+#define VECTOR_LANES 2
+#endif
+#define MAX_BANK_GROUPS (64 / VECTOR_LANES)
+#define MAX_BANK_FILTERS (VECTOR_LANES * MAX_BANK_GROUPS)
+
+typedef double lanes_t __attribute__((vector_size(VECTOR_LANES * sizeof(double))));
+typedef int64_t lanes_mask_t __attribute__((vector_size(VECTOR_LANES * sizeof(int64_t))));
+
+static inline lanes_t lanes_abs(lanes_t x) {
+  return (lanes_t)((lanes_mask_t)x & (INT64_MAX));
+}
+
+static inline lanes_t lanes_select(lanes_mask_t mask, lanes_t a, lanes_t b) {
+  return (lanes_t)(((lanes_mask_t)a & mask) | ((lanes_mask_t)b & ~mask));
+}
+
+
+// Simple filters, one per lane
+
+typedef struct low_pass_lanes {
+  lanes_t coefficient;
+  lanes_t last_output;
+} low_pass_lanes;
+
+static inline lanes_t low_pass_lanes_process(low_pass_lanes *filter, lanes_t sample) {
+  lanes_t a = filter->coefficient;
+  lanes_t output = a * sample + (1 - a) * filter->last_output;
+  filter->last_output = output;
+  return output;
+}
+
+typedef struct high_pass_lanes {
+  lanes_t coefficient;
+  lanes_t last_input;
+  lanes_t last_output;
+} high_pass_lanes;
+
+static inline lanes_t high_pass_lanes_process(high_pass_lanes *filter, lanes_t sample) {
+  lanes_t output = filter->coefficient * (sample + filter->last_output - filter->last_input);
+  filter->last_input = sample;
+  filter->last_output = output;
+  return output;
+}
+
+typedef struct attack_release_lanes {
+  lanes_t attack;
+  lanes_t release;
+  lanes_t last_output;
+} attack_release_lanes;
+
+static inline lanes_t attack_release_lanes_process(attack_release_lanes *filter, lanes_t sample) {
+  lanes_t a = lanes_select(sample > filter->last_output, filter->attack, filter->release);
+  lanes_t output = a * filter->last_output + (1 - a) * sample;
+  filter->last_output = output;
+  return output;
+}
+
+
+// Volume follower, one per lane
+
+typedef struct volume_follow_lanes {
+  lanes_mask_t band_hp_active [BAND_STAGES];
+  high_pass_lanes band_hp_filters [BAND_STAGES];
+  lanes_mask_t band_lp_active [BAND_STAGES];
+  low_pass_lanes band_lp_filters [BAND_STAGES];
+
+  high_pass_lanes hp_filters [MAX_STAGES];
+  attack_release_lanes ar_filter;
+  low_pass_lanes lp_filters [MAX_STAGES];
+  high_pass_lanes emphasis_filter;
+  lanes_t emphasis_opacity;
+  attack_release_lanes smooth_filter;
+} volume_follow_lanes;
+
+/**
+ * Load the coefficients and state of a scalar filter into a lane.
+ **/
+static inline void volume_follow_lanes_set(volume_follow_lanes *lanes, size_t lane,
+    const volume_follow_filter *filter) {
+  const envelope_follow_filter *envelope = &filter->envelope_follower;
+  size_t i;
+  for (i = 0; i < BAND_STAGES; i++) {
+    const high_pass_filter *hp = &filter->band_hp_filters[i];
+    const low_pass_filter *lp = &filter->band_lp_filters[i];
+    lanes->band_hp_active[i][lane] = (i < filter->band_high_stages) ? -1 : 0;
+    lanes->band_lp_active[i][lane] = (i < filter->band_low_stages) ? -1 : 0;
+    if (i < filter->band_high_stages) {
+      lanes->band_hp_filters[i].coefficient[lane] = hp->coefficient;
+      lanes->band_hp_filters[i].last_input[lane] = hp->last_input;
+      lanes->band_hp_filters[i].last_output[lane] = hp->last_output;
+    }
+    if (i < filter->band_low_stages) {
+      lanes->band_lp_filters[i].coefficient[lane] = lp->coefficient;
+      lanes->band_lp_filters[i].last_output[lane] = lp->last_output;
+    }
+  }
+  for (i = 0; i < envelope->high_stages; i++) {
+    lanes->hp_filters[i].coefficient[lane] = envelope->hp_filters[i].coefficient;
+    lanes->hp_filters[i].last_input[lane] = envelope->hp_filters[i].last_input;
+    lanes->hp_filters[i].last_output[lane] = envelope->hp_filters[i].last_output;
+  }
+  lanes->ar_filter.attack[lane] = envelope->ar_filter.attack;
+  lanes->ar_filter.release[lane] = envelope->ar_filter.release;
+  lanes->ar_filter.last_output[lane] = envelope->ar_filter.last_output;
+  for (i = 0; i < envelope->low_stages; i++) {
+    lanes->lp_filters[i].coefficient[lane] = envelope->lp_filters[i].coefficient;
+    lanes->lp_filters[i].last_output[lane] = envelope->lp_filters[i].last_output;
+  }
+  lanes->emphasis_filter.coefficient[lane] = filter->emphasis_filter.coefficient;
+  lanes->emphasis_filter.last_input[lane] = filter->emphasis_filter.last_input;
+  lanes->emphasis_filter.last_output[lane] = filter->emphasis_filter.last_output;
+  lanes->emphasis_opacity[lane] = filter->emphasis_opacity;
+  lanes->smooth_filter.attack[lane] = filter->smooth_filter.attack;
+  lanes->smooth_filter.release[lane] = filter->smooth_filter.release;
+  lanes->smooth_filter.last_output[lane] = filter->smooth_filter.last_output;
+}
+
+/**
+ * Apply the band-pass stages. Lanes with less stages than others
+ * still run them, but their output is discarded.
+ **/
+static inline lanes_t volume_follow_lanes_band(volume_follow_lanes *lanes, lanes_t sample) {
+  size_t i;
+  for (i = 0; i < BAND_STAGES; i++)
+    sample = lanes_select(lanes->band_hp_active[i],
+        high_pass_lanes_process(&lanes->band_hp_filters[i], sample), sample);
+  for (i = 0; i < BAND_STAGES; i++)
+    sample = lanes_select(lanes->band_lp_active[i],
+        low_pass_lanes_process(&lanes->band_lp_filters[i], sample), sample);
+  return sample;
+}
+
+static inline lanes_t volume_follow_lanes_envelope(volume_follow_lanes *lanes,
+    size_t high_stages, size_t low_stages, lanes_t sample) {
+  size_t i;
+  lanes_t cleaned = sample;
+  for (i = 0; i < high_stages; i++)
+    cleaned = high_pass_lanes_process(&lanes->hp_filters[i], cleaned);
+  cleaned = lanes_abs(cleaned);
+
+  lanes_t envelope = attack_release_lanes_process(&lanes->ar_filter, cleaned);
+  for (i = 0; i < low_stages; i++)
+    envelope = low_pass_lanes_process(&lanes->lp_filters[i], envelope);
+  return envelope;
+}
+
+static inline lanes_t volume_follow_lanes_smooth(volume_follow_lanes *lanes, lanes_t envelope) {
+  lanes_t emphasized = high_pass_lanes_process(&lanes->emphasis_filter, envelope);
+  lanes_t opacity = lanes->emphasis_opacity;
+  emphasized = opacity * emphasized + (1 - opacity) * envelope;
+  return attack_release_lanes_process(&lanes->smooth_filter, emphasized);
+}
+
+
+// Bank of filters
+
+typedef struct volume_bank {
+  size_t high_stages;
+  size_t low_stages;
+  int smooth_decimated;
+  int band_pass;
+  size_t phase;
+  size_t count;
+  volume_follow_lanes groups [MAX_BANK_GROUPS];
+} volume_bank;
+
+static inline void volume_bank_init(volume_bank *bank, size_t high_stages,
+    size_t low_stages, int smooth_decimated) {
+  memset(bank, 0x00, sizeof(*bank));
+  bank->high_stages = high_stages;
+  bank->low_stages = low_stages;
+  bank->smooth_decimated = smooth_decimated;
+}
+
+/**
+ * Append a filter to the bank. Its stage counts must match the bank's.
+ * Returns non-zero if the bank is full or the stages don't match.
+ **/
+static inline int volume_bank_add(volume_bank *bank, const volume_follow_filter *filter) {
+  if (bank->count >= MAX_BANK_FILTERS) return 1;
+  if (filter->envelope_follower.high_stages != bank->high_stages ||
+      filter->envelope_follower.low_stages != bank->low_stages)
+    return 1;
+  if (filter->band_high_stages || filter->band_low_stages)
+    bank->band_pass = 1;
+  size_t index = bank->count++;
+  volume_follow_lanes_set(&bank->groups[index / VECTOR_LANES], index % VECTOR_LANES, filter);
+  return 0;
+}
+
+/**
+ * Process `length` samples on every filter of the bank, storing one level
+ * per filter every `interval` samples (like `volume_follow_process_decimated`).
+ * `inputs` holds one pointer per filter, which may be repeated to have many
+ * filters read the same input. Levels are stored frame by frame, that is,
+ * level for filter `f` at frame `i` is stored at `levels[i * count + f]`.
+ * Returns the number of frames stored.
+ **/
+static inline size_t volume_bank_process_decimated(volume_bank *bank,
+    const float *const *inputs, size_t length, size_t interval, double *levels) {
+  size_t high_stages = bank->high_stages, low_stages = bank->low_stages;
+  size_t count = bank->count, frames = 0, phase = bank->phase;
+  size_t group, lane, i;
+
+  for (group = 0; group * VECTOR_LANES < count; group++) {
+    volume_follow_lanes lanes = bank->groups[group];
+    const float *group_inputs [VECTOR_LANES];
+    size_t first = group * VECTOR_LANES;
+    size_t used = (count - first < VECTOR_LANES) ? count - first : VECTOR_LANES;
+    for (lane = 0; lane < VECTOR_LANES; lane++)
+      group_inputs[lane] = inputs[first + (lane < used ? lane : 0)];
+
+    lanes_t level = {0};
+    phase = bank->phase;
+    frames = 0;
+    for (i = 0; i < length; i++) {
+      lanes_t sample;
+      for (lane = 0; lane < VECTOR_LANES; lane++)
+        sample[lane] = group_inputs[lane][i];
+      if (bank->band_pass)
+        sample = volume_follow_lanes_band(&lanes, sample);
+
+      lanes_t envelope = volume_follow_lanes_envelope(&lanes, high_stages, low_stages, sample);
+      if (!bank->smooth_decimated)
+        level = volume_follow_lanes_smooth(&lanes, envelope);
+
+      if (++phase < interval) continue;
+      phase = 0;
+      if (bank->smooth_decimated)
+        level = volume_follow_lanes_smooth(&lanes, envelope);
+      for (lane = 0; lane < used; lane++)
+        levels[frames * count + first + lane] = level[lane];
+      frames++;
+    }
+    bank->groups[group] = lanes;
+  }
+
+  bank->phase = phase;
+  return frames;
+}
+
+#endif
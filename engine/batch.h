@@ -0,0 +1,95 @@
+/**
+ * Batched LEDP sender. Servers are resolved once when added to the
+ * batch, and then the datagrams for all of them are built into a
+ * single buffer and sent with one `sendmmsg()` call, instead of
+ * one syscall per server.
+ **/
+
+#ifndef ENGINE_BATCH_H
+#define ENGINE_BATCH_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MAX_BATCH_SERVERS 64
+#define LEDP_PACKET_SIZE 9
+#define LEDP_PROTOCOL_VERSION 1
+
+typedef struct ledp_batch {
+  size_t count;
+  struct sockaddr_storage addresses [MAX_BATCH_SERVERS];
+  socklen_t address_lengths [MAX_BATCH_SERVERS];
+  uint8_t packets [MAX_BATCH_SERVERS][LEDP_PACKET_SIZE];
+  struct iovec iovecs [MAX_BATCH_SERVERS];
+  struct mmsghdr messages [MAX_BATCH_SERVERS];
+} ledp_batch;
+
+static inline void ledp_batch_init(ledp_batch *batch) {
+  memset(batch, 0x00, sizeof(*batch));
+}
+
+/**
+ * Resolve a server and append it to the batch. Returns its index,
+ * or -1 if the batch is full or the server couldn't be resolved.
+ **/
+static inline int ledp_batch_add(ledp_batch *batch, int family, const char *host, const char *port) {
+  struct addrinfo hints, *addresses;
+  if (batch->count >= MAX_BATCH_SERVERS) return -1;
+
+  memset(&hints, 0x00, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &addresses) != 0) return -1;
+
+  size_t index = batch->count++;
+  memcpy(&batch->addresses[index], addresses->ai_addr, addresses->ai_addrlen);
+  batch->address_lengths[index] = addresses->ai_addrlen;
+  freeaddrinfo(addresses);
+  return index;
+}
+
+/**
+ * Send a LEDP message to `count` servers of the batch through `sock`.
+ * The message for `indices[i]` has `masks[i]` and `values[i]`.
+ * Returns the number of messages sent, which is less than `count` on
+ * error (see errno), or -1 if none was sent.
+ **/
+static inline int ledp_batch_send(ledp_batch *batch, int sock, size_t count,
+    const uint32_t *indices, const uint32_t *masks, const uint32_t *values) {
+  size_t i;
+  if (count > MAX_BATCH_SERVERS) count = MAX_BATCH_SERVERS;
+
+  for (i = 0; i < count; i++) {
+    size_t index = indices[i];
+    uint8_t *packet = batch->packets[i];
+    uint32_t mask = htonl(masks[i]), value = htonl(values[i]);
+    packet[0] = LEDP_PROTOCOL_VERSION;
+    memcpy(packet + 1, &mask, 4);
+    memcpy(packet + 5, &value, 4);
+
+    batch->iovecs[i].iov_base = packet;
+    batch->iovecs[i].iov_len = LEDP_PACKET_SIZE;
+    struct msghdr *header = &batch->messages[i].msg_hdr;
+    memset(header, 0x00, sizeof(*header));
+    header->msg_name = &batch->addresses[index];
+    header->msg_namelen = batch->address_lengths[index];
+    header->msg_iov = &batch->iovecs[i];
+    header->msg_iovlen = 1;
+  }
+
+  // sendmmsg may send less messages than asked for
+  size_t sent = 0;
+  while (sent < count) {
+    int status = sendmmsg(sock, batch->messages + sent, count - sent, 0);
+    if (status < 0 && errno == EINTR) continue;
+    if (status < 0) return sent ? (int)sent : -1;
+    sent += status;
+  }
+  return sent;
+}
+
+#endif
@@ -0,0 +1,70 @@
+/**
+ * Precompiled specializations of `VolumeFollow` (see `cascade.hpp`) for
+ * the default stages used by `VolumeFollowFilter` (3 high-pass stages,
+ * 2 low-pass stages), with and without each side of the band-pass.
+ * Other stage counts use the generic implementation in `filters.h`.
+ **/
+
+#include "cascade.hpp"
+#include "cascade.h"
+
+template struct VolumeFollow<0, 3, 0, 2>;
+template struct VolumeFollow<BAND_STAGES, 3, 0, 2>;
+template struct VolumeFollow<0, 3, BAND_STAGES, 2>;
+template struct VolumeFollow<BAND_STAGES, 3, BAND_STAGES, 2>;
+
+typedef void (*buffer_function)(volume_follow_filter *, const float *, double *, size_t);
+typedef void (*block_function)(volume_follow_filter *, const double *, double *, size_t);
+typedef size_t (*decimated_function)(volume_follow_filter *, const float *, size_t, size_t, double *);
+
+struct specialization {
+  bool (*matches)(const volume_follow_filter *);
+  buffer_function process_buffer;
+  block_function process_block;
+  decimated_function process_decimated;
+};
+
+#define SPECIALIZATION(...) { \
+  VolumeFollow<__VA_ARGS__>::matches, \
+  VolumeFollow<__VA_ARGS__>::process_buffer<float>, \
+  VolumeFollow<__VA_ARGS__>::process_buffer<double>, \
+  VolumeFollow<__VA_ARGS__>::process_decimated, \
+}
+
+static const specialization specializations [] = {
+  SPECIALIZATION(0, 3, 0, 2),
+  SPECIALIZATION(BAND_STAGES, 3, 0, 2),
+  SPECIALIZATION(0, 3, BAND_STAGES, 2),
+  SPECIALIZATION(BAND_STAGES, 3, BAND_STAGES, 2),
+};
+
+static const specialization *find_specialization(const volume_follow_filter *filter) {
+  for (size_t i = 0; i < sizeof(specializations) / sizeof(*specializations); i++)
+    if (specializations[i].matches(filter)) return &specializations[i];
+  return NULL;
+}
+
+void cascade_process_buffer(volume_follow_filter *filter,
+    const float *input, double *output, size_t length) {
+  const specialization *s = find_specialization(filter);
+  if (s) return s->process_buffer(filter, input, output, length);
+
+  for (size_t i = 0; i < length; i++)
+    output[i] = volume_follow_process(filter, input[i]);
+}
+
+void cascade_process_block(volume_follow_filter *filter,
+    double *buffer, size_t length) {
+  const specialization *s = find_specialization(filter);
+  if (s) return s->process_block(filter, buffer, buffer, length);
+
+  for (size_t i = 0; i < length; i++)
+    buffer[i] = volume_follow_process(filter, buffer[i]);
+}
+
+size_t cascade_process_decimated(volume_follow_filter *filter,
+    const float *input, size_t length, size_t interval, double *levels) {
+  const specialization *s = find_specialization(filter);
+  if (s) return s->process_decimated(filter, input, length, interval, levels);
+  return volume_follow_process_decimated(filter, input, length, interval, levels);
+}
@@ -0,0 +1,28 @@
+/**
+ * C interface to the specialized filter cascades in `cascade.cpp`.
+ * These functions behave exactly like their counterparts in `filters.h`,
+ * but use a compile-time specialized implementation if there's one for
+ * the stages of the filter, falling back to the generic one otherwise.
+ **/
+
+#ifndef ENGINE_CASCADE_H
+#define ENGINE_CASCADE_H
+
+#include "filters.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void cascade_process_buffer(volume_follow_filter *filter,
+    const float *input, double *output, size_t length);
+void cascade_process_block(volume_follow_filter *filter,
+    double *buffer, size_t length);
+size_t cascade_process_decimated(volume_follow_filter *filter,
+    const float *input, size_t length, size_t interval, double *levels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
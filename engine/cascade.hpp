@@ -0,0 +1,209 @@
+/**
+ * Compile-time specialized version of the volume follower in `filters.h`.
+ * The number of stages of every cascade is a template parameter, so the
+ * loops over stages are unrolled, and since the filter is copied into a
+ * local object while a buffer is processed, its state stays in registers.
+ * The arithmetic is exactly the same as in `filters.h`.
+ **/
+
+#ifndef ENGINE_CASCADE_HPP
+#define ENGINE_CASCADE_HPP
+
+#include <math.h>
+#include <stddef.h>
+
+extern "C" {
+#include "filters.h"
+}
+
+
+// Simple filters
+
+struct LowPass {
+  typedef low_pass_filter state_type;
+  double coefficient, last_output;
+
+  void load(const low_pass_filter &filter) {
+    coefficient = filter.coefficient;
+    last_output = filter.last_output;
+  }
+  void store(low_pass_filter &filter) const {
+    filter.last_output = last_output;
+  }
+  inline double process(double sample) {
+    double a = coefficient;
+    double output = a * sample + (1 - a) * last_output;
+    last_output = output;
+    return output;
+  }
+};
+
+struct HighPass {
+  typedef high_pass_filter state_type;
+  double coefficient, last_input, last_output;
+
+  void load(const high_pass_filter &filter) {
+    coefficient = filter.coefficient;
+    last_input = filter.last_input;
+    last_output = filter.last_output;
+  }
+  void store(high_pass_filter &filter) const {
+    filter.last_input = last_input;
+    filter.last_output = last_output;
+  }
+  inline double process(double sample) {
+    double output = coefficient * (sample + last_output - last_input);
+    last_input = sample;
+    last_output = output;
+    return output;
+  }
+};
+
+struct AttackRelease {
+  typedef attack_release_filter state_type;
+  double attack, release, last_output;
+
+  void load(const attack_release_filter &filter) {
+    attack = filter.attack;
+    release = filter.release;
+    last_output = filter.last_output;
+  }
+  void store(attack_release_filter &filter) const {
+    filter.last_output = last_output;
+  }
+  inline double process(double sample) {
+    double a = (sample > last_output) ? attack : release;
+    double output = a * last_output + (1 - a) * sample;
+    last_output = output;
+    return output;
+  }
+};
+
+
+// Cascade of `Stages` filters of the same type
+
+template <typename Filter, size_t Stages>
+struct Cascade {
+  typedef typename Filter::state_type state_type;
+  Filter stages [Stages];
+
+  void load(const state_type *filters) {
+    for (size_t i = 0; i < Stages; i++) stages[i].load(filters[i]);
+  }
+  void store(state_type *filters) const {
+    for (size_t i = 0; i < Stages; i++) stages[i].store(filters[i]);
+  }
+  inline double process(double sample) {
+    for (size_t i = 0; i < Stages; i++) sample = stages[i].process(sample);
+    return sample;
+  }
+};
+
+template <typename Filter>
+struct Cascade<Filter, 0> {
+  typedef typename Filter::state_type state_type;
+  void load(const state_type *) {}
+  void store(state_type *) const {}
+  inline double process(double sample) { return sample; }
+};
+
+
+// Volume follower
+
+template <size_t BandHighStages, size_t HighStages, size_t BandLowStages, size_t LowStages>
+struct VolumeFollow {
+  Cascade<HighPass, BandHighStages> band_hp_filters;
+  Cascade<LowPass, BandLowStages> band_lp_filters;
+  Cascade<HighPass, HighStages> hp_filters;
+  AttackRelease ar_filter;
+  Cascade<LowPass, LowStages> lp_filters;
+  HighPass emphasis_filter;
+  double emphasis_opacity;
+  AttackRelease smooth_filter;
+
+  /**
+   * Whether `filter` has the stages of this specialization.
+   **/
+  static bool matches(const volume_follow_filter *filter) {
+    return filter->band_high_stages == BandHighStages &&
+           filter->band_low_stages == BandLowStages &&
+           filter->envelope_follower.high_stages == HighStages &&
+           filter->envelope_follower.low_stages == LowStages;
+  }
+
+  void load(const volume_follow_filter *filter) {
+    band_hp_filters.load(filter->band_hp_filters);
+    band_lp_filters.load(filter->band_lp_filters);
+    hp_filters.load(filter->envelope_follower.hp_filters);
+    ar_filter.load(filter->envelope_follower.ar_filter);
+    lp_filters.load(filter->envelope_follower.lp_filters);
+    emphasis_filter.load(filter->emphasis_filter);
+    emphasis_opacity = filter->emphasis_opacity;
+    smooth_filter.load(filter->smooth_filter);
+  }
+
+  void store(volume_follow_filter *filter) const {
+    band_hp_filters.store(filter->band_hp_filters);
+    band_lp_filters.store(filter->band_lp_filters);
+    hp_filters.store(filter->envelope_follower.hp_filters);
+    ar_filter.store(filter->envelope_follower.ar_filter);
+    lp_filters.store(filter->envelope_follower.lp_filters);
+    emphasis_filter.store(filter->emphasis_filter);
+    smooth_filter.store(filter->smooth_filter);
+  }
+
+  inline double envelope(double sample) {
+    sample = band_lp_filters.process(band_hp_filters.process(sample));
+    double cleaned = fabs(hp_filters.process(sample));
+    return lp_filters.process(ar_filter.process(cleaned));
+  }
+
+  inline double smooth(double envelope) {
+    double emphasized = emphasis_filter.process(envelope);
+    double opacity = emphasis_opacity;
+    emphasized = opacity * emphasized + (1 - opacity) * envelope;
+    return smooth_filter.process(emphasized);
+  }
+
+  /**
+   * Same as `volume_follow_process`, over a whole buffer.
+   * `output` may be the same as `input`.
+   **/
+  template <typename Sample>
+  static void process_buffer(volume_follow_filter *filter,
+      const Sample *input, double *output, size_t length) {
+    VolumeFollow follower;
+    follower.load(filter);
+    for (size_t i = 0; i < length; i++)
+      output[i] = follower.smooth(follower.envelope(input[i]));
+    follower.store(filter);
+  }
+
+  /**
+   * Same as `volume_follow_process_decimated`.
+   **/
+  static size_t process_decimated(volume_follow_filter *filter,
+      const float *input, size_t length, size_t interval, double *levels) {
+    VolumeFollow follower;
+    follower.load(filter);
+    size_t phase = filter->phase, count = 0;
+    bool smooth_decimated = filter->smooth_decimated;
+    double level = 0;
+    for (size_t i = 0; i < length; i++) {
+      double envelope = follower.envelope(input[i]);
+      if (!smooth_decimated)
+        level = follower.smooth(envelope);
+
+      if (++phase < interval) continue;
+      phase = 0;
+      if (smooth_decimated)
+        level = follower.smooth(envelope);
+      levels[count++] = level;
+    }
+    filter->phase = phase;
+    follower.store(filter);
+    return count;
+  }
+};
+
+#endif
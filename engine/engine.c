@@ -0,0 +1,116 @@
+/**
+ * Shared library exposing the native filter engine to `filters.py`
+ * (through ctypes). The filter state lives in a single flat struct
+ * allocated by the caller, and whole JACK buffers are processed
+ * per call, for a single filter or a vectorized bank of them, or for
+ * the loudness filter (see `loudness.h`).
+ *
+ * Single filters are processed by the specialized cascades in
+ * `cascade.cpp` when possible. It also has a batched LEDP sender,
+ * used by `ledp.py`.
+ *
+ * cc -c engine.c -O2 -ffp-contract=off -Wall -Wextra -fPIC
+ * c++ -c cascade.cpp -O2 -ffp-contract=off -Wall -Wextra -fPIC
+ * c++ -shared engine.o cascade.o -lm -o libengine.so
+ **/
+
+#define _GNU_SOURCE
+#include "bank.h"
+#include "batch.h"
+#include "cascade.h"
+#include "loudness.h"
+
+size_t volume_follow_size(void) {
+  return sizeof(volume_follow_filter);
+}
+
+int volume_follow_setup(volume_follow_filter *filter,
+    size_t high_stages, double high_coefficient, double release,
+    size_t low_stages, double low_coefficient,
+    double emphasis_coefficient, double emphasis_opacity,
+    double smooth_attack, double smooth_release, int smooth_decimated,
+    size_t band_high_stages, double band_high_coefficient,
+    size_t band_low_stages, double band_low_coefficient) {
+  if (high_stages > MAX_STAGES || low_stages > MAX_STAGES)
+    return 1;
+  if (band_high_stages > BAND_STAGES || band_low_stages > BAND_STAGES)
+    return 1;
+
+  envelope_follow_filter envelope_follower;
+  envelope_follow_init(&envelope_follower, high_stages, high_coefficient,
+                       release, low_stages, low_coefficient);
+  volume_follow_init(filter, &envelope_follower, emphasis_coefficient,
+                     emphasis_opacity, smooth_attack, smooth_release,
+                     smooth_decimated);
+  volume_follow_init_band(filter, band_high_stages, band_high_coefficient,
+                          band_low_stages, band_low_coefficient);
+  return 0;
+}
+
+void volume_follow_process_buffer(volume_follow_filter *filter,
+    const float *input, double *output, size_t length) {
+  cascade_process_buffer(filter, input, output, length);
+}
+
+void volume_follow_process_block(volume_follow_filter *filter,
+    double *buffer, size_t length) {
+  cascade_process_block(filter, buffer, length);
+}
+
+size_t volume_follow_process_decimated_buffer(volume_follow_filter *filter,
+    const float *input, size_t length, size_t interval, double *levels) {
+  return cascade_process_decimated(filter, input, length, interval, levels);
+}
+
+size_t volume_bank_size(void) {
+  return sizeof(volume_bank);
+}
+
+void volume_bank_setup(volume_bank *bank, size_t high_stages,
+    size_t low_stages, int smooth_decimated) {
+  volume_bank_init(bank, high_stages, low_stages, smooth_decimated);
+}
+
+int volume_bank_add_filter(volume_bank *bank, const volume_follow_filter *filter) {
+  return volume_bank_add(bank, filter);
+}
+
+size_t volume_bank_process_decimated_buffer(volume_bank *bank,
+    const float *const *inputs, size_t length, size_t interval, double *levels) {
+  return volume_bank_process_decimated(bank, inputs, length, interval, levels);
+}
+
+size_t loudness_size(void) {
+  return sizeof(loudness_filter);
+}
+
+int loudness_setup(loudness_filter *filter, size_t window_hops,
+    size_t hop_length, double scale, const double *weighting,
+    size_t band_high_stages, double band_high_coefficient,
+    size_t band_low_stages, double band_low_coefficient) {
+  return loudness_init(filter, window_hops, hop_length, scale, weighting,
+                       band_high_stages, band_high_coefficient,
+                       band_low_stages, band_low_coefficient);
+}
+
+size_t loudness_process_decimated_buffer(loudness_filter *filter,
+    const float *input, size_t length, double *levels) {
+  return loudness_process_decimated(filter, input, length, levels);
+}
+
+size_t ledp_batch_size(void) {
+  return sizeof(ledp_batch);
+}
+
+void ledp_batch_setup(ledp_batch *batch) {
+  ledp_batch_init(batch);
+}
+
+int ledp_batch_add_server(ledp_batch *batch, int family, const char *host, const char *port) {
+  return ledp_batch_add(batch, family, host, port);
+}
+
+int ledp_batch_send_buffer(ledp_batch *batch, int sock, size_t count,
+    const uint32_t *indices, const uint32_t *masks, const uint32_t *values) {
+  return ledp_batch_send(batch, sock, count, indices, masks, values);
+}
@@ -0,0 +1,215 @@
+/**
+ * Native implementation of the filters in `filters.py`.
+ * Each filter keeps its state in a plain struct, and performs
+ * exactly the same arithmetic (in the same order) as its Python
+ * counterpart, so both give identical output.
+ *
+ * Everything here is static, so that the compiler can inline the
+ * whole chain into the per-buffer loop of the caller.
+ **/
+
+#ifndef ENGINE_FILTERS_H
+#define ENGINE_FILTERS_H
+
+#include <math.h>
+#include <stddef.h>
+
+#define MAX_STAGES 8
+#define BAND_STAGES 2
+
+
+// Simple filters
+
+typedef struct low_pass_filter {
+  double coefficient;
+  double last_output;
+} low_pass_filter;
+
+static inline void low_pass_init(low_pass_filter *filter, double coefficient) {
+  filter->coefficient = coefficient;
+  filter->last_output = 0;
+}
+
+static inline double low_pass_process(low_pass_filter *filter, double sample) {
+  double a = filter->coefficient;
+  double output = a * sample + (1 - a) * filter->last_output;
+  filter->last_output = output;
+  return output;
+}
+
+typedef struct high_pass_filter {
+  double coefficient;
+  double last_input;
+  double last_output;
+} high_pass_filter;
+
+static inline void high_pass_init(high_pass_filter *filter, double coefficient) {
+  filter->coefficient = coefficient;
+  filter->last_input = 0;
+  filter->last_output = 0;
+}
+
+static inline double high_pass_process(high_pass_filter *filter, double sample) {
+  double output = filter->coefficient * (sample + filter->last_output - filter->last_input);
+  filter->last_input = sample;
+  filter->last_output = output;
+  return output;
+}
+
+typedef struct attack_release_filter {
+  double attack;
+  double release;
+  double last_output;
+} attack_release_filter;
+
+static inline void attack_release_init(attack_release_filter *filter, double attack, double release) {
+  filter->attack = attack;
+  filter->release = release;
+  filter->last_output = 0;
+}
+
+static inline double attack_release_process(attack_release_filter *filter, double sample) {
+  double a = (sample > filter->last_output) ? filter->attack : filter->release;
+  double output = a * filter->last_output + (1 - a) * sample;
+  filter->last_output = output;
+  return output;
+}
+
+
+// More complex filters
+
+typedef struct envelope_follow_filter {
+  size_t high_stages;
+  high_pass_filter hp_filters [MAX_STAGES];
+  attack_release_filter ar_filter;
+  size_t low_stages;
+  low_pass_filter lp_filters [MAX_STAGES];
+} envelope_follow_filter;
+
+static inline void envelope_follow_init(envelope_follow_filter *filter,
+    size_t high_stages, double high_coefficient, double release,
+    size_t low_stages, double low_coefficient) {
+  size_t i;
+  filter->high_stages = high_stages;
+  for (i = 0; i < high_stages; i++)
+    high_pass_init(&filter->hp_filters[i], high_coefficient);
+  attack_release_init(&filter->ar_filter, 0, release);
+  filter->low_stages = low_stages;
+  for (i = 0; i < low_stages; i++)
+    low_pass_init(&filter->lp_filters[i], low_coefficient);
+}
+
+static inline double envelope_follow_process(envelope_follow_filter *filter, double sample) {
+  size_t i;
+
+  // Clean low frequencies and DC, then rectify
+  double cleaned = sample;
+  for (i = 0; i < filter->high_stages; i++)
+    cleaned = high_pass_process(&filter->hp_filters[i], cleaned);
+  cleaned = fabs(cleaned);
+
+  // Follow the envelope, then clean its HF noise
+  double envelope = attack_release_process(&filter->ar_filter, cleaned);
+  for (i = 0; i < filter->low_stages; i++)
+    envelope = low_pass_process(&filter->lp_filters[i], envelope);
+  return envelope;
+}
+
+typedef struct volume_follow_filter {
+  // Optional band-pass applied to the input
+  size_t band_high_stages;
+  high_pass_filter band_hp_filters [BAND_STAGES];
+  size_t band_low_stages;
+  low_pass_filter band_lp_filters [BAND_STAGES];
+
+  envelope_follow_filter envelope_follower;
+  high_pass_filter emphasis_filter;
+  double emphasis_opacity;
+  attack_release_filter smooth_filter;
+
+  // Decimation state: samples since the last emitted level, and
+  // whether the emphasis / smoothing stages run at the decimated rate
+  size_t phase;
+  int smooth_decimated;
+} volume_follow_filter;
+
+static inline void volume_follow_init_band(volume_follow_filter *filter,
+    size_t high_stages, double high_coefficient,
+    size_t low_stages, double low_coefficient) {
+  size_t i;
+  filter->band_high_stages = high_stages;
+  for (i = 0; i < high_stages; i++)
+    high_pass_init(&filter->band_hp_filters[i], high_coefficient);
+  filter->band_low_stages = low_stages;
+  for (i = 0; i < low_stages; i++)
+    low_pass_init(&filter->band_lp_filters[i], low_coefficient);
+}
+
+/**
+ * Initialize the filter, without band-pass. Call `volume_follow_init_band`
+ * afterwards to enable it.
+ **/
+static inline void volume_follow_init(volume_follow_filter *filter,
+    const envelope_follow_filter *envelope_follower,
+    double emphasis_coefficient, double emphasis_opacity,
+    double smooth_attack, double smooth_release, int smooth_decimated) {
+  volume_follow_init_band(filter, 0, 0, 0, 0);
+  filter->envelope_follower = *envelope_follower;
+  high_pass_init(&filter->emphasis_filter, emphasis_coefficient);
+  filter->emphasis_opacity = emphasis_opacity;
+  attack_release_init(&filter->smooth_filter, smooth_attack, smooth_release);
+  filter->phase = 0;
+  filter->smooth_decimated = smooth_decimated;
+}
+
+static inline double volume_follow_band(volume_follow_filter *filter, double sample) {
+  size_t i;
+  for (i = 0; i < filter->band_high_stages; i++)
+    sample = high_pass_process(&filter->band_hp_filters[i], sample);
+  for (i = 0; i < filter->band_low_stages; i++)
+    sample = low_pass_process(&filter->band_lp_filters[i], sample);
+  return sample;
+}
+
+static inline double volume_follow_smooth(volume_follow_filter *filter, double envelope) {
+  // Partially apply the emphasis high-pass
+  double emphasized = high_pass_process(&filter->emphasis_filter, envelope);
+  double opacity = filter->emphasis_opacity;
+  emphasized = opacity * emphasized + (1 - opacity) * envelope;
+
+  return attack_release_process(&filter->smooth_filter, emphasized);
+}
+
+static inline double volume_follow_process(volume_follow_filter *filter, double sample) {
+  sample = volume_follow_band(filter, sample);
+  double envelope = envelope_follow_process(&filter->envelope_follower, sample);
+  return volume_follow_smooth(filter, envelope);
+}
+
+/**
+ * Process `length` samples, but only store one level every `interval`
+ * samples. The phase is kept in the filter, so levels are exactly
+ * `interval` samples apart regardless of how the input is split.
+ * `levels` needs room for `length / interval + 1` levels; the number
+ * of stored levels is returned.
+ **/
+static inline size_t volume_follow_process_decimated(volume_follow_filter *filter,
+    const float *input, size_t length, size_t interval, double *levels) {
+  size_t i, count = 0;
+  double level = 0;
+  for (i = 0; i < length; i++) {
+    double sample = volume_follow_band(filter, input[i]);
+    double envelope = envelope_follow_process(&filter->envelope_follower, sample);
+    if (!filter->smooth_decimated)
+      level = volume_follow_smooth(filter, envelope);
+
+    if (++filter->phase < interval) continue;
+    filter->phase = 0;
+    if (filter->smooth_decimated)
+      level = volume_follow_smooth(filter, envelope);
+    levels[count++] = level;
+  }
+  return count;
+}
+
+#endif
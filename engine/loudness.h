@@ -0,0 +1,208 @@
+/**
+ * Native implementation of `LoudnessFilter` in `filters.py`: the mean power
+ * of the input over a sliding window, optionally K-weighted (ITU-R BS.1770),
+ * with the same arithmetic (in the same order) as the Python one.
+ *
+ * The window slides by hops of `interval` samples, one hop per level. The
+ * squares of a hop are summed into four partial sums (by the position of
+ * the sample in the hop), which the compiler can keep in vector registers,
+ * and the window sum is a running total of the sums of the last hops.
+ * So the cost is O(1) per sample, whatever the window length.
+ **/
+
+#ifndef ENGINE_LOUDNESS_H
+#define ENGINE_LOUDNESS_H
+
+#include <string.h>
+#include "filters.h"
+
+#define MAX_WINDOW_HOPS 256
+#define SUM_LANES 4
+
+
+// Biquad filter (direct form I), for the K-weighting
+
+typedef struct biquad_filter {
+  double b0, b1, b2, a1, a2;
+  double x1, x2, y1, y2;
+} biquad_filter;
+
+static inline void biquad_init(biquad_filter *filter, const double *coefficients) {
+  filter->b0 = coefficients[0];
+  filter->b1 = coefficients[1];
+  filter->b2 = coefficients[2];
+  filter->a1 = coefficients[3];
+  filter->a2 = coefficients[4];
+  filter->x1 = filter->x2 = filter->y1 = filter->y2 = 0;
+}
+
+static inline double biquad_process(biquad_filter *filter, double sample) {
+  double output = filter->b0 * sample + filter->b1 * filter->x1 + filter->b2 * filter->x2
+                - filter->a1 * filter->y1 - filter->a2 * filter->y2;
+  filter->x2 = filter->x1;
+  filter->x1 = sample;
+  filter->y2 = filter->y1;
+  filter->y1 = output;
+  return output;
+}
+
+
+// Loudness filter
+
+typedef struct loudness_filter {
+  // Optional band-pass applied to the input
+  size_t band_high_stages;
+  high_pass_filter band_hp_filters [BAND_STAGES];
+  size_t band_low_stages;
+  low_pass_filter band_lp_filters [BAND_STAGES];
+
+  // Optional K-weighting: shelving filter, then high-pass
+  int weighted;
+  biquad_filter weighting [2];
+
+  // Sums of the squares of the last hops (a ring), their total,
+  // and the partial sums of the current hop
+  size_t hop_length;
+  size_t window_hops;
+  double hop_sums [MAX_WINDOW_HOPS];
+  size_t hop;
+  double window_sum;
+  double partial_sums [SUM_LANES];
+  size_t phase;
+
+  // Factor from the window sum to the level
+  double scale;
+} loudness_filter;
+
+/**
+ * Initialize the filter, for a window of `window_hops` hops of `hop_length`
+ * samples. `weighting` has the coefficients (b0, b1, b2, a1, a2) of the two
+ * K-weighting stages, or is NULL. Returns non-zero if the window is too long.
+ **/
+static inline int loudness_init(loudness_filter *filter, size_t window_hops,
+    size_t hop_length, double scale, const double *weighting,
+    size_t band_high_stages, double band_high_coefficient,
+    size_t band_low_stages, double band_low_coefficient) {
+  size_t i;
+  if (!window_hops || window_hops > MAX_WINDOW_HOPS || !hop_length)
+    return 1;
+  if (band_high_stages > BAND_STAGES || band_low_stages > BAND_STAGES)
+    return 1;
+
+  memset(filter, 0, sizeof(*filter));
+  filter->band_high_stages = band_high_stages;
+  for (i = 0; i < band_high_stages; i++)
+    high_pass_init(&filter->band_hp_filters[i], band_high_coefficient);
+  filter->band_low_stages = band_low_stages;
+  for (i = 0; i < band_low_stages; i++)
+    low_pass_init(&filter->band_lp_filters[i], band_low_coefficient);
+
+  filter->weighted = weighting != NULL;
+  if (weighting) {
+    biquad_init(&filter->weighting[0], weighting);
+    biquad_init(&filter->weighting[1], weighting + 5);
+  }
+  filter->hop_length = hop_length;
+  filter->window_hops = window_hops;
+  filter->scale = scale;
+  return 0;
+}
+
+static inline double loudness_prefilter(loudness_filter *filter, double sample) {
+  size_t i;
+  for (i = 0; i < filter->band_high_stages; i++)
+    sample = high_pass_process(&filter->band_hp_filters[i], sample);
+  for (i = 0; i < filter->band_low_stages; i++)
+    sample = low_pass_process(&filter->band_lp_filters[i], sample);
+  if (filter->weighted) {
+    sample = biquad_process(&filter->weighting[0], sample);
+    sample = biquad_process(&filter->weighting[1], sample);
+  }
+  return sample;
+}
+
+/**
+ * Add the squares of `length` samples (which don't go past the end
+ * of the hop) to the partial sums.
+ **/
+static inline void loudness_add_squares(loudness_filter *filter, const float *input, size_t length) {
+  size_t i = 0, phase = filter->phase;
+  double *sums = filter->partial_sums;
+
+  if (filter->weighted || filter->band_high_stages || filter->band_low_stages) {
+    for (; i < length; i++, phase++) {
+      double sample = loudness_prefilter(filter, input[i]);
+      sums[phase % SUM_LANES] += sample * sample;
+    }
+    filter->phase = phase;
+    return;
+  }
+
+  // Without prefilters, the squares are independent: align
+  // to the lanes, then add them four at a time
+  for (; i < length && phase % SUM_LANES; i++, phase++) {
+    double sample = input[i];
+    sums[phase % SUM_LANES] += sample * sample;
+  }
+  double s0 = sums[0], s1 = sums[1], s2 = sums[2], s3 = sums[3];
+  for (; i + SUM_LANES <= length; i += SUM_LANES, phase += SUM_LANES) {
+    double x0 = input[i], x1 = input[i+1], x2 = input[i+2], x3 = input[i+3];
+    s0 += x0 * x0;
+    s1 += x1 * x1;
+    s2 += x2 * x2;
+    s3 += x3 * x3;
+  }
+  sums[0] = s0; sums[1] = s1; sums[2] = s2; sums[3] = s3;
+  for (; i < length; i++, phase++) {
+    double sample = input[i];
+    sums[phase % SUM_LANES] += sample * sample;
+  }
+  filter->phase = phase;
+}
+
+/**
+ * End the current hop: slide the window by it, and return the level.
+ **/
+static inline double loudness_end_hop(loudness_filter *filter) {
+  double *sums = filter->partial_sums;
+  double hop_sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  sums[0] = sums[1] = sums[2] = sums[3] = 0;
+  filter->phase = 0;
+
+  double oldest = filter->hop_sums[filter->hop];
+  filter->hop_sums[filter->hop] = hop_sum;
+  filter->window_sum += hop_sum - oldest;
+
+  // Recompute the total once per window, so rounding errors don't build up
+  if (++filter->hop == filter->window_hops) {
+    size_t i;
+    double total = 0;
+    filter->hop = 0;
+    for (i = 0; i < filter->window_hops; i++)
+      total += filter->hop_sums[i];
+    filter->window_sum = total;
+  }
+  return filter->window_sum * filter->scale;
+}
+
+/**
+ * Process `length` samples, storing a level at the end of every hop
+ * (like `volume_follow_process_decimated`, with the hop length as the
+ * interval). `levels` needs room for `length / hop_length + 1` levels;
+ * the number of stored levels is returned.
+ **/
+static inline size_t loudness_process_decimated(loudness_filter *filter,
+    const float *input, size_t length, double *levels) {
+  size_t offset = 0, count = 0;
+  while (offset < length) {
+    size_t chunk = filter->hop_length - filter->phase;
+    if (chunk > length - offset) chunk = length - offset;
+    loudness_add_squares(filter, input + offset, chunk);
+    offset += chunk;
+    if (filter->phase == filter->hop_length)
+      levels[count++] = loudness_end_hop(filter);
+  }
+  return count;
+}
+
+#endif
@@ -0,0 +1,163 @@
+/**
+ * Real-time metering mode. A JACK client whose process callback runs
+ * a bank of volume filters (see `bank.h`) directly over the JACK buffer,
+ * and pushes the levels into a lock-free ring (see `ring.h`). A non-RT
+ * thread (the Python main thread, through `realtime.py`) drains the ring
+ * and does the network sends. The RT thread never touches the network
+ * or the allocator. There can be many input ports: every filter of the
+ * bank reads one of them.
+ * cc realtime.c -O2 -ffp-contract=off -Wall -Wextra -shared -fPIC -ljack -lpthread -lm -o librealtime.so
+ **/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <semaphore.h>
+#include <jack/jack.h>
+#include "ring.h"
+
+#define MAX_INPUTS 32
+
+typedef struct realtime_meter {
+  jack_client_t *client;
+  jack_port_t *ports [MAX_INPUTS];
+  size_t port_count;
+  volume_bank bank;
+  size_t interval;
+
+  // Input port read by every filter of the bank
+  unsigned sources [MAX_BANK_FILTERS];
+
+  level_ring ring;
+  sem_t available;
+  atomic_size_t overruns;
+} realtime_meter;
+
+static int realtime_process(jack_nframes_t nframes, void *opaque) {
+  realtime_meter *meter = opaque;
+  const float *buffers [MAX_INPUTS];
+  const float *inputs [MAX_BANK_FILTERS];
+  double discarded [MAX_BANK_FILTERS];
+  size_t offset, chunk, i;
+
+  for (i = 0; i < meter->port_count; i++)
+    buffers[i] = jack_port_get_buffer(meter->ports[i], nframes);
+
+  // Process up to the next level each time, so that at most one
+  // level is produced and it can be written directly into the ring
+  for (offset = 0; offset < nframes; offset += chunk) {
+    chunk = meter->interval - meter->bank.phase;
+    if (chunk > nframes - offset) chunk = nframes - offset;
+    for (i = 0; i < meter->bank.count; i++)
+      inputs[i] = buffers[meter->sources[i]] + offset;
+
+    double *levels = level_ring_reserve(&meter->ring);
+    if (!levels) levels = discarded;
+    if (!volume_bank_process_decimated(&meter->bank, inputs, chunk, meter->interval, levels))
+      continue;
+
+    if (levels == discarded) {
+      atomic_fetch_add_explicit(&meter->overruns, 1, memory_order_relaxed);
+      continue;
+    }
+    level_ring_commit(&meter->ring);
+    sem_post(&meter->available);
+  }
+  return 0;
+}
+
+/**
+ * Open a JACK client with `inputs` input ports, named `input` if there's
+ * only one, `input_1`, `input_2`... otherwise. Returns NULL on failure.
+ **/
+realtime_meter *realtime_open(const char *name, size_t inputs) {
+  if (!inputs || inputs > MAX_INPUTS) return NULL;
+  realtime_meter *meter = calloc(1, sizeof(realtime_meter));
+  if (!meter) return NULL;
+
+  meter->client = jack_client_open(name, JackNullOption, NULL);
+  if (!meter->client) {
+    free(meter);
+    return NULL;
+  }
+  for (meter->port_count = 0; meter->port_count < inputs; meter->port_count++) {
+    char port_name [16];
+    if (inputs == 1)
+      strcpy(port_name, "input");
+    else
+      sprintf(port_name, "input_%u", (unsigned)meter->port_count + 1);
+    meter->ports[meter->port_count] = jack_port_register(meter->client, port_name,
+        JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput | JackPortIsTerminal | JackPortIsPhysical, 0);
+    if (!meter->ports[meter->port_count]) {
+      jack_client_close(meter->client);
+      free(meter);
+      return NULL;
+    }
+  }
+  return meter;
+}
+
+unsigned realtime_sample_rate(realtime_meter *meter) {
+  return jack_get_sample_rate(meter->client);
+}
+
+unsigned realtime_buffer_size(realtime_meter *meter) {
+  return jack_get_buffer_size(meter->client);
+}
+
+/**
+ * Copy the bank into the meter, and start processing audio, storing
+ * a frame of levels every `interval` samples. `sources` has the input
+ * port (from zero) of every filter, or is NULL for all to read the
+ * first one. Returns non-zero on failure.
+ **/
+int realtime_start(realtime_meter *meter, const volume_bank *bank, size_t interval,
+    const unsigned *sources) {
+  size_t i;
+  if (!interval) return 1;
+  for (i = 0; i < bank->count; i++) {
+    meter->sources[i] = sources ? sources[i] : 0;
+    if (meter->sources[i] >= meter->port_count) return 1;
+  }
+  meter->bank = *bank;
+  meter->interval = interval;
+  level_ring_init(&meter->ring, bank->count);
+  atomic_init(&meter->overruns, 0);
+  if (sem_init(&meter->available, 0, 0)) return 1;
+
+  if (jack_set_process_callback(meter->client, realtime_process, meter)) return 1;
+  return jack_activate(meter->client);
+}
+
+/**
+ * Wait (at most `timeout_ms`) for levels to be available, and copy up to
+ * `max_frames` frames of them into `levels`. Returns the number of frames.
+ **/
+size_t realtime_read(realtime_meter *meter, double *levels, size_t max_frames, unsigned timeout_ms) {
+  size_t count = level_ring_read(&meter->ring, levels, max_frames);
+  if (count) return count;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (sem_timedwait(&meter->available, &deadline) && errno == EINTR);
+  return level_ring_read(&meter->ring, levels, max_frames);
+}
+
+size_t realtime_overruns(realtime_meter *meter) {
+  return atomic_load(&meter->overruns);
+}
+
+void realtime_close(realtime_meter *meter) {
+  jack_deactivate(meter->client);
+  jack_client_close(meter->client);
+  sem_destroy(&meter->available);
+  free(meter);
+}
@@ -0,0 +1,63 @@
+/**
+ * Lock-free, single-producer single-consumer ring of level frames.
+ * Used to hand the levels computed in the JACK real-time thread to
+ * the network thread without locks, syscalls or allocation on the
+ * producer side. Each frame holds one level per filter of a bank.
+ **/
+
+#ifndef ENGINE_RING_H
+#define ENGINE_RING_H
+
+#include <stdatomic.h>
+#include <string.h>
+#include "bank.h"
+
+// Must be a power of two
+#define RING_FRAMES 256
+
+typedef struct level_ring {
+  _Alignas(64) atomic_size_t head; // only written by the producer
+  _Alignas(64) atomic_size_t tail; // only written by the consumer
+  size_t width;
+  double frames [RING_FRAMES][MAX_BANK_FILTERS];
+} level_ring;
+
+static inline void level_ring_init(level_ring *ring, size_t width) {
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->width = width;
+}
+
+/**
+ * Producer: return the frame to write next, or NULL if the ring is full.
+ * The frame isn't visible to the consumer until `level_ring_commit`.
+ **/
+static inline double *level_ring_reserve(level_ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail >= RING_FRAMES) return NULL;
+  return ring->frames[head % RING_FRAMES];
+}
+
+static inline void level_ring_commit(level_ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Consumer: copy up to `max_frames` frames into `levels` (frame by frame,
+ * `width` levels each) and release them. Returns the number of frames copied.
+ **/
+static inline size_t level_ring_read(level_ring *ring, double *levels, size_t max_frames) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t count = head - tail, i;
+  if (count > max_frames) count = max_frames;
+  for (i = 0; i < count; i++)
+    memcpy(levels + i * ring->width, ring->frames[(tail + i) % RING_FRAMES],
+           ring->width * sizeof(double));
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+  return count;
+}
+
+#endif
@@ -5,9 +5,20 @@ the volume (amplitude) of the audio at any point in time.
 
 Every X samples, led-meter picks a processed sample, and uses
 some logic to map it into a number of LEDs.
+
+The filters are implemented in pure Python, and the whole chain
+is also available as a native engine (see `engine/`) which is much
+faster and gives identical output.
 """
 
-from math import pi
+import array
+import ctypes
+import native
+from native import buffer_pointer
+from math import pi, tan
+
+# Number of stages of each side of the optional band-pass
+band_stages = 2
 
 
 # Simple filters
@@ -42,6 +53,17 @@ class LowPassFilter:
         self.last_output = output
         return output
 
+    def process_block(self, buffer, n):
+        """
+        Process the first `n` samples of `buffer` in place.
+        """
+        a = self.coefficient
+        output = self.last_output
+        for i in xrange(n):
+            output = a * buffer[i] + (1 - a) * output
+            buffer[i] = output
+        self.last_output = output
+
 class HighPassFilter:
     """
     Simple high-pass filter, single pole.
@@ -73,6 +95,19 @@ class HighPassFilter:
         self.last_output = output
         return output
 
+    def process_block(self, buffer, n):
+        """
+        Process the first `n` samples of `buffer` in place.
+        """
+        a = self.coefficient
+        last_input, output = self.last_input, self.last_output
+        for i in xrange(n):
+            sample = buffer[i]
+            output = a * (sample + output - last_input)
+            last_input = sample
+            buffer[i] = output
+        self.last_input, self.last_output = last_input, output
+
 class AttackReleaseFilter:
     """
     Simple attack-release filter. This is pretty much like `LowPassFilter`,
@@ -109,6 +144,19 @@ class AttackReleaseFilter:
         self.last_output = output
         return output
 
+    def process_block(self, buffer, n):
+        """
+        Process the first `n` samples of `buffer` in place.
+        """
+        attack, release = self.attack, self.release
+        output = self.last_output
+        for i in xrange(n):
+            sample = buffer[i]
+            a = attack if sample > output else release
+            output = a * output + (1 - a) * sample
+            buffer[i] = output
+        self.last_output = output
+
 
 # More complex filters
 
@@ -131,10 +179,25 @@ class EnvelopeFollowFilter:
         used to scale the cutoff frequencies for the low-pass and high-pass
         filters, and their stages (number of times the filter takes place).
         """
-        # Initialize the high-pass filter to clean frequencies
+        high, release, low = EnvelopeFollowFilter.get_coefficients(
+            cutoff_frames, release_point,
+            high_cutoff_coefficient, low_cutoff_coefficient)
+
+        self.hp_filters = [HighPassFilter(high) for i in xrange(high_stages)]
+        self.ar_filter = AttackReleaseFilter(attack=0, release=release)
+        self.lp_filters = [LowPassFilter(low) for i in xrange(low_stages)]
+
+    @staticmethod
+    def get_coefficients(cutoff_frames, release_point=0.4,
+                         high_cutoff_coefficient=0.5, low_cutoff_coefficient=3.0):
+        """
+        Calculate the coefficients for the high-pass stages, the
+        attack-release filter (release) and the low-pass stages, returned
+        as a tuple in that order. Parameters are the same as the constructor.
+        """
+        # The high-pass filter cleans frequencies
         # lower than our specified cutoff frequency.
-        coefficient = HighPassFilter.get_coefficient(cutoff_frames / high_cutoff_coefficient)
-        self.hp_filters = [HighPassFilter(coefficient) for i in xrange(high_stages)]
+        high = HighPassFilter.get_coefficient(cutoff_frames / high_cutoff_coefficient)
 
         # The attack-release filter must have zero attack time, we're
         # going to follow the envelope. Now, the release: because we're
@@ -142,13 +205,13 @@ class EnvelopeFollowFilter:
         # between peaks, and in that time we should transfer `release_point`.
         peak_spacing = cutoff_frames / 2
         release = AttackReleaseFilter.get_coefficient(peak_spacing, release_point)
-        self.ar_filter = AttackReleaseFilter(attack=0, release=release)
 
         # Since the time between peaks will be `peak_spacing` or lower,
         # the noise starts at frequency `1 / peak_spacing`. Our low pass
         # filter should remove this, and higher frequencies from the envelope.
-        coefficient = LowPassFilter.get_coefficient(peak_spacing / low_cutoff_coefficient)
-        self.lp_filters = [LowPassFilter(coefficient) for i in xrange(low_stages)]
+        low = LowPassFilter.get_coefficient(peak_spacing / low_cutoff_coefficient)
+
+        return high, release, low
 
     def process(self, sample):
         """
@@ -172,6 +235,19 @@ class EnvelopeFollowFilter:
             envelope = lp_filter.process(envelope)
         return envelope
 
+    def process_block(self, buffer, n):
+        """
+        Process the first `n` samples of `buffer` in place. Each stage
+        runs over the whole block before the next one.
+        """
+        for hp_filter in self.hp_filters:
+            hp_filter.process_block(buffer, n)
+        for i in xrange(n):
+            buffer[i] = abs(buffer[i])
+        self.ar_filter.process_block(buffer, n)
+        for lp_filter in self.lp_filters:
+            lp_filter.process_block(buffer, n)
+
 class VolumeFollowFilter:
     """
     Follows the average volume of the supplied audio, using
@@ -184,19 +260,40 @@ class VolumeFollowFilter:
     FIXME: An envelope follower (alone) is not the right tool for measuring
     volume, since it tracks amplitude rather than power or perceived loudness.
     This can be palliated by using multiple meters, with band-passes each
-    covering different sections of the spectrum.
+    covering different sections of the spectrum, or by measuring the power
+    with `LoudnessFilter` instead.
     """
 
     def __init__(self, envelope_cutoff_frames,
                  emphasis_cutoff_frames, emphasis_opacity,
-                 smooth_attack_coefficient, smooth_release_coefficient):
+                 smooth_attack_coefficient, smooth_release_coefficient,
+                 smooth_decimated=False,
+                 band_start_frames=None, band_end_frames=None):
         """
         Initialize the filter with a cutoff frequency for the envelope follower,
         the opacity and cutoff frequency for the high-pass (emphasis) filter,
         and the two coefficients for the final attack-release filter, used
         to smooth the envelope to make it suitable for display.
+
+        If `smooth_decimated` is true, `process_decimated()` will run the
+        emphasis and smoothing stages only once per interval, so the
+        frames and coefficients for them must be calculated at that rate.
+
+        `band_start_frames` and `band_end_frames` optionally apply a band-pass
+        to the input before anything else, so that the filter only follows a
+        part of the spectrum. They are the periods of the lowest and highest
+        frequencies of the band, in frames.
         """
-        # First, build the envelope follower.
+        # First, the optional band-pass.
+        self.band_filters = []
+        if band_start_frames is not None:
+            coefficient = HighPassFilter.get_coefficient(band_start_frames)
+            self.band_filters += [HighPassFilter(coefficient) for i in xrange(band_stages)]
+        if band_end_frames is not None:
+            coefficient = LowPassFilter.get_coefficient(band_end_frames)
+            self.band_filters += [LowPassFilter(coefficient) for i in xrange(band_stages)]
+
+        # Then, build the envelope follower.
         self.envelope_follower = EnvelopeFollowFilter(envelope_cutoff_frames)
 
         # Then, the high-pass filter for emphasis.
@@ -207,13 +304,24 @@ class VolumeFollowFilter:
         # And the final attack-release filter.
         self.smooth_filter = AttackReleaseFilter(smooth_attack_coefficient, smooth_release_coefficient)
 
+        # Decimation state, see `process_decimated()`.
+        self.smooth_decimated = smooth_decimated
+        self.phase = 0
+
     def process(self, sample):
         """
         Process a sample with the filter, and return the processed sample.
         """
-        # First, get the envelope of the input.
+        # First, get the envelope of the (band-passed) input.
+        for band_filter in self.band_filters:
+            sample = band_filter.process(sample)
         envelope = self.envelope_follower.process(sample)
+        return self.smooth(envelope)
 
+    def smooth(self, envelope):
+        """
+        Apply the emphasis and smoothing stages to an envelope sample.
+        """
         # Now that we have the immediate amplitude, we want to emphasize sudden
         # changes (high frequencies) over constant amplitude (low frequencies),
         # so we partially apply a high-pass filter to the envelope.
@@ -226,3 +334,448 @@ class VolumeFollowFilter:
         # apply a final attack-release filter over it.
         smoothed = self.smooth_filter.process(emphasized)
         return smoothed
+
+    def process_buffer(self, input, output):
+        """
+        Process every sample in `input`, storing the processed
+        samples at the same positions of `output`.
+        """
+        n = len(input)
+        for i in xrange(n):
+            output[i] = input[i]
+        self.process_block(output, n)
+
+    def process_block(self, buffer, n):
+        """
+        Process the first `n` samples of `buffer` in place. Note that
+        `buffer` should hold doubles (i.e. a list), not single floats.
+        """
+        for band_filter in self.band_filters:
+            band_filter.process_block(buffer, n)
+        self.envelope_follower.process_block(buffer, n)
+        for i in xrange(n):
+            buffer[i] = self.smooth(buffer[i])
+
+    def process_decimated(self, input, interval, levels):
+        """
+        Process every sample in `input`, but only store one processed
+        sample every `interval` samples into `levels`. The phase is kept
+        across calls, so levels are exactly `interval` samples apart no
+        matter how the input is split in buffers. `levels` needs room for
+        `len(input) // interval + 1` levels. Returns the number of levels stored.
+        """
+        count = 0
+        level = 0
+        envelopes = input.tolist() if hasattr(input, "tolist") else list(input)
+        for band_filter in self.band_filters:
+            band_filter.process_block(envelopes, len(envelopes))
+        self.envelope_follower.process_block(envelopes, len(envelopes))
+        for envelope in envelopes:
+            if not self.smooth_decimated:
+                level = self.smooth(envelope)
+
+            self.phase += 1
+            if self.phase < interval: continue
+            self.phase = 0
+            if self.smooth_decimated:
+                level = self.smooth(envelope)
+            levels[count] = level
+            count += 1
+        return count
+
+class VolumeFollowBank:
+    """
+    Runs many `VolumeFollowFilter`s side by side, over the same input
+    or over different ones (i.e. several meters, or several channels).
+    """
+
+    def __init__(self, filters):
+        """
+        Initialize the bank with a list of `VolumeFollowFilter`s (or
+        any other filters with `process_decimated()`, native or not).
+        """
+        self.filters = filters
+
+    def process_decimated(self, inputs, interval, levels):
+        """
+        Call `process_decimated()` on each filter, with the input at
+        the same position of `inputs`. `levels` is a list of rows, one
+        for each frame, containing the level of every filter.
+        Returns the number of frames stored.
+        """
+        column = array.array("d", [0]) * (len(inputs[0]) // interval + 1)
+        for f, (filter, input) in enumerate(zip(self.filters, inputs)):
+            count = filter.process_decimated(input, interval, column)
+            for i in xrange(count):
+                levels[i][f] = column[i]
+        return count
+
+
+# Loudness measurement
+
+# Most hops a `LoudnessFilter` window can have (MAX_WINDOW_HOPS in engine/loudness.h)
+max_window_hops = 256
+
+# Lanes of the partial sums (SUM_LANES in engine/loudness.h)
+sum_lanes = 4
+
+class LoudnessFilter:
+    """
+    Measures the mean power of the audio over a sliding window: its RMS
+    (squared), or its loudness if K-weighted as in ITU-R BS.1770. So,
+    unlike `VolumeFollowFilter`, the levels are powers and the decibels
+    from them are true dBFS (or LUFS).
+
+    The window slides by hops of `hop_frames` samples, and a level is given
+    for every hop. The squares of each hop are summed (into `sum_lanes`
+    partial sums, by position, which the native engine adds in parallel),
+    and the sum of the window is a running total of the last hop sums.
+    So there's no per-sample recursion, apart from the optional filters.
+    """
+
+    @staticmethod
+    def get_k_weighting(sample_rate):
+        """
+        Calculate the coefficients (b0, b1, b2, a1, a2) of the two stages
+        of the K-weighting, a high shelf and a high-pass, at a sample rate.
+        """
+        # Shelving filter
+        frequency, gain, q = 1681.974450955533, 3.999843853973347, 0.7071752369554196
+        k = tan(pi * frequency / sample_rate)
+        vh = 10 ** (gain / 20)
+        vb = vh ** 0.4996667741545416
+        a0 = 1 + k / q + k * k
+        shelf = ((vh + vb * k / q + k * k) / a0, 2 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0,
+                 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0)
+
+        # High-pass filter
+        frequency, q = 38.13547087602444, 0.5003270373238773
+        k = tan(pi * frequency / sample_rate)
+        a0 = 1 + k / q + k * k
+        high = (1.0, -2.0, 1.0, 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0)
+        return shelf, high
+
+    @staticmethod
+    def get_parameters(window_frames, hop_frames, k_weighted):
+        """
+        Return the number of hops of the window, and the factor
+        that converts the window sum into the level.
+        """
+        window_hops = max(1, int(round(float(window_frames) / hop_frames)))
+        if window_hops > max_window_hops:
+            raise Exception("loudness window too long, at most %d frames" % (max_window_hops * hop_frames))
+        scale = 1.0 / (window_hops * hop_frames)
+        if k_weighted:
+            scale *= 10 ** (-0.691 / 10)
+        return window_hops, scale
+
+    def __init__(self, window_frames, hop_frames, sample_rate=None,
+                 band_start_frames=None, band_end_frames=None):
+        """
+        Initialize the filter, with a window of (about) `window_frames`
+        samples, rounded to hops of `hop_frames` samples. If `sample_rate`
+        is given, the audio is K-weighted for that rate. `band_start_frames`
+        and `band_end_frames` are as in `VolumeFollowFilter`.
+        """
+        self.band_filters = []
+        if band_start_frames is not None:
+            coefficient = HighPassFilter.get_coefficient(band_start_frames)
+            self.band_filters += [HighPassFilter(coefficient) for i in xrange(band_stages)]
+        if band_end_frames is not None:
+            coefficient = LowPassFilter.get_coefficient(band_end_frames)
+            self.band_filters += [LowPassFilter(coefficient) for i in xrange(band_stages)]
+
+        self.weighting = None
+        if sample_rate is not None:
+            self.weighting = [list(stage) + [0, 0, 0, 0] for stage in LoudnessFilter.get_k_weighting(sample_rate)]
+
+        self.hop_frames = hop_frames
+        self.window_hops, self.scale = LoudnessFilter.get_parameters(window_frames, hop_frames, sample_rate is not None)
+        self.hop_sums = [0.0] * self.window_hops
+        self.hop = 0
+        self.window_sum = 0.0
+        self.partial_sums = [0.0] * sum_lanes
+        self.phase = 0
+
+    def prefilter(self, sample):
+        """
+        Apply the band-pass and the K-weighting to a sample.
+        """
+        for band_filter in self.band_filters:
+            sample = band_filter.process(sample)
+        if self.weighting is not None:
+            for stage in self.weighting:
+                b0, b1, b2, a1, a2, x1, x2, y1, y2 = stage
+                output = b0 * sample + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2
+                stage[5:] = [sample, x1, output, y1]
+                sample = output
+        return sample
+
+    def end_hop(self):
+        """
+        Slide the window by the current hop, and return the level.
+        """
+        sums = self.partial_sums
+        hop_sum = (sums[0] + sums[1]) + (sums[2] + sums[3])
+        self.partial_sums = [0.0] * sum_lanes
+        self.phase = 0
+
+        oldest = self.hop_sums[self.hop]
+        self.hop_sums[self.hop] = hop_sum
+        self.window_sum += hop_sum - oldest
+
+        # Recompute the total once per window, so rounding errors don't build up
+        self.hop += 1
+        if self.hop == self.window_hops:
+            self.hop = 0
+            total = 0.0
+            for hop_sum in self.hop_sums:
+                total += hop_sum
+            self.window_sum = total
+        return self.window_sum * self.scale
+
+    def process_decimated(self, input, interval, levels):
+        """
+        Process every sample in `input`, storing the level at the end
+        of every hop into `levels`. `interval` has to be the hop length.
+        `levels` needs room for `len(input) // interval + 1` levels.
+        Returns the number of levels stored.
+        """
+        assert interval == self.hop_frames
+        count = 0
+        filtered = self.band_filters or self.weighting is not None
+        for sample in input:
+            sample = float(sample)
+            if filtered:
+                sample = self.prefilter(sample)
+            self.partial_sums[self.phase % sum_lanes] += sample * sample
+            self.phase += 1
+            if self.phase == self.hop_frames:
+                levels[count] = self.end_hop()
+                count += 1
+        return count
+
+
+# Native engine
+
+def declare_engine(library):
+    """
+    Declare the functions of the native engine used by this module.
+    """
+    c_float_p = ctypes.POINTER(ctypes.c_float)
+    c_double_p = ctypes.POINTER(ctypes.c_double)
+    library.volume_follow_size.restype = ctypes.c_size_t
+    library.volume_follow_size.argtypes = []
+    library.volume_follow_setup.restype = ctypes.c_int
+    library.volume_follow_setup.argtypes = [ctypes.c_void_p,
+        ctypes.c_size_t, ctypes.c_double, ctypes.c_double,
+        ctypes.c_size_t, ctypes.c_double,
+        ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double,
+        ctypes.c_int,
+        ctypes.c_size_t, ctypes.c_double, ctypes.c_size_t, ctypes.c_double]
+    library.volume_follow_process_buffer.restype = None
+    library.volume_follow_process_buffer.argtypes = [ctypes.c_void_p,
+        c_float_p, c_double_p, ctypes.c_size_t]
+    library.volume_follow_process_block.restype = None
+    library.volume_follow_process_block.argtypes = [ctypes.c_void_p,
+        c_double_p, ctypes.c_size_t]
+    library.volume_follow_process_decimated_buffer.restype = ctypes.c_size_t
+    library.volume_follow_process_decimated_buffer.argtypes = [ctypes.c_void_p,
+        c_float_p, ctypes.c_size_t, ctypes.c_size_t, c_double_p]
+
+    library.loudness_size.restype = ctypes.c_size_t
+    library.loudness_size.argtypes = []
+    library.loudness_setup.restype = ctypes.c_int
+    library.loudness_setup.argtypes = [ctypes.c_void_p,
+        ctypes.c_size_t, ctypes.c_size_t, ctypes.c_double, c_double_p,
+        ctypes.c_size_t, ctypes.c_double, ctypes.c_size_t, ctypes.c_double]
+    library.loudness_process_decimated_buffer.restype = ctypes.c_size_t
+    library.loudness_process_decimated_buffer.argtypes = [ctypes.c_void_p,
+        c_float_p, ctypes.c_size_t, c_double_p]
+
+    library.volume_bank_size.restype = ctypes.c_size_t
+    library.volume_bank_size.argtypes = []
+    library.volume_bank_setup.restype = None
+    library.volume_bank_setup.argtypes = [ctypes.c_void_p,
+        ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int]
+    library.volume_bank_add_filter.restype = ctypes.c_int
+    library.volume_bank_add_filter.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    library.volume_bank_process_decimated_buffer.restype = ctypes.c_size_t
+    library.volume_bank_process_decimated_buffer.argtypes = [ctypes.c_void_p,
+        ctypes.POINTER(c_float_p), ctypes.c_size_t, ctypes.c_size_t, c_double_p]
+
+engine = native.library
+if engine is not None:
+    declare_engine(engine)
+
+class NativeVolumeFollowFilter:
+    """
+    Same as `VolumeFollowFilter`, but backed by the native engine.
+    The whole filter chain lives in a single C struct, and buffers are
+    processed in one call. The output is identical to `VolumeFollowFilter`.
+
+    The processing methods expect `input` to hold single-precision floats
+    (like the JACK buffers do) and `output` / `levels` doubles.
+    """
+
+    def __init__(self, envelope_cutoff_frames,
+                 emphasis_cutoff_frames, emphasis_opacity,
+                 smooth_attack_coefficient, smooth_release_coefficient,
+                 smooth_decimated=False,
+                 band_start_frames=None, band_end_frames=None):
+        """
+        Initialize the filter. Parameters are the same as `VolumeFollowFilter`.
+        """
+        if engine is None:
+            raise Exception("native engine not available, compile engine/libengine.so")
+
+        high, release, low = EnvelopeFollowFilter.get_coefficients(envelope_cutoff_frames)
+        emphasis = HighPassFilter.get_coefficient(emphasis_cutoff_frames)
+        band_high = band_low = 0
+        if band_start_frames is not None:
+            band_high = HighPassFilter.get_coefficient(band_start_frames)
+        if band_end_frames is not None:
+            band_low = LowPassFilter.get_coefficient(band_end_frames)
+
+        self.smooth_decimated = smooth_decimated
+        self.state = ctypes.create_string_buffer(engine.volume_follow_size())
+        # Stages are the `EnvelopeFollowFilter` defaults
+        status = engine.volume_follow_setup(self.state,
+            3, high, release, 2, low,
+            emphasis, emphasis_opacity,
+            smooth_attack_coefficient, smooth_release_coefficient,
+            smooth_decimated,
+            band_stages if band_start_frames is not None else 0, band_high,
+            band_stages if band_end_frames is not None else 0, band_low)
+        if status:
+            raise Exception("too many filter stages")
+
+    def process_buffer(self, input, output):
+        """
+        Process every sample in `input`, storing the processed
+        samples at the same positions of `output`.
+        """
+        assert len(output) >= len(input)
+        engine.volume_follow_process_buffer(self.state,
+            buffer_pointer(input, ctypes.c_float),
+            buffer_pointer(output, ctypes.c_double), len(input))
+
+    def process_block(self, buffer, n):
+        """
+        Process the first `n` samples of `buffer` (doubles) in place.
+        """
+        assert len(buffer) >= n
+        engine.volume_follow_process_block(self.state,
+            buffer_pointer(buffer, ctypes.c_double), n)
+
+    def process_decimated(self, input, interval, levels):
+        """
+        Process every sample in `input`, but only store one processed
+        sample every `interval` samples into `levels`.
+        See `VolumeFollowFilter.process_decimated()`.
+        """
+        assert len(levels) >= len(input) // interval + 1
+        return engine.volume_follow_process_decimated_buffer(self.state,
+            buffer_pointer(input, ctypes.c_float), len(input), interval,
+            buffer_pointer(levels, ctypes.c_double))
+
+class NativeVolumeFollowBank:
+    """
+    Same as `VolumeFollowBank`, but backed by the native engine. The
+    filters are packed into SIMD lanes and processed together, which is
+    much cheaper than running them one after another.
+    """
+
+    def __init__(self, filters):
+        """
+        Initialize the bank with a list of `NativeVolumeFollowFilter`s,
+        which all have to use the same `smooth_decimated` setting.
+        Their current state is copied into the bank.
+        """
+        smooth_decimated = filters[0].smooth_decimated
+        if any(filter.smooth_decimated != smooth_decimated for filter in filters):
+            raise Exception("all filters in a bank must use the same smoothing rate")
+
+        self.state = ctypes.create_string_buffer(engine.volume_bank_size())
+        engine.volume_bank_setup(self.state, 3, 2, smooth_decimated)
+        for filter in filters:
+            if engine.volume_bank_add_filter(self.state, filter.state):
+                raise Exception("too many filters in bank")
+        self.count = len(filters)
+        self.binding = None
+
+    def bind(self, inputs, levels):
+        """
+        Validate the buffers and compute the pointers to them. Done once
+        for every set of buffers, so that processing the same buffers
+        (i.e. the JACK ones) again doesn't need any allocation or marshalling.
+        """
+        assert len(inputs) == self.count and levels.shape[1] == self.count
+        length = len(inputs[0])
+        assert all(len(input) == length for input in inputs)
+        pointers = (ctypes.POINTER(ctypes.c_float) * self.count)(
+            *[buffer_pointer(input, ctypes.c_float) for input in inputs])
+        levels_pointer = buffer_pointer(levels, ctypes.c_double)
+        self.binding = (inputs, levels, length, pointers, levels_pointer)
+
+    def process_decimated(self, inputs, interval, levels):
+        """
+        Process the input at each position of `inputs` with the filter at the
+        same position. `levels` is a 2D array of doubles (frames x filters).
+        See `VolumeFollowBank.process_decimated()`.
+
+        The filters read the memory of `inputs` directly, without copying it.
+        If `inputs` is the same list (and `levels` the same array) as in the
+        last call, the pointers from that call are reused.
+        """
+        binding = self.binding
+        if binding is None or binding[0] is not inputs or binding[1] is not levels:
+            self.bind(inputs, levels)
+            binding = self.binding
+        length, pointers, levels_pointer = binding[2:]
+        assert len(levels) >= length // interval + 1
+        return engine.volume_bank_process_decimated_buffer(self.state,
+            pointers, length, interval, levels_pointer)
+
+class NativeLoudnessFilter:
+    """
+    Same as `LoudnessFilter`, but backed by the native engine (see
+    `engine/loudness.h`). The output is identical to `LoudnessFilter`.
+    """
+
+    def __init__(self, window_frames, hop_frames, sample_rate=None,
+                 band_start_frames=None, band_end_frames=None):
+        """
+        Initialize the filter. Parameters are the same as `LoudnessFilter`.
+        """
+        if engine is None:
+            raise Exception("native engine not available, compile engine/libengine.so")
+
+        window_hops, scale = LoudnessFilter.get_parameters(window_frames, hop_frames, sample_rate is not None)
+        weighting = None
+        if sample_rate is not None:
+            weighting = (ctypes.c_double * 10)(*sum(LoudnessFilter.get_k_weighting(sample_rate), ()))
+        band_high = band_low = 0
+        if band_start_frames is not None:
+            band_high = HighPassFilter.get_coefficient(band_start_frames)
+        if band_end_frames is not None:
+            band_low = LowPassFilter.get_coefficient(band_end_frames)
+
+        self.hop_frames = hop_frames
+        self.state = ctypes.create_string_buffer(engine.loudness_size())
+        status = engine.loudness_setup(self.state, window_hops, hop_frames, scale, weighting,
+            band_stages if band_start_frames is not None else 0, band_high,
+            band_stages if band_end_frames is not None else 0, band_low)
+        if status:
+            raise Exception("invalid loudness filter parameters")
+
+    def process_decimated(self, input, interval, levels):
+        """
+        Process every sample in `input`, storing the level at the end of
+        every hop into `levels`. See `LoudnessFilter.process_decimated()`.
+        """
+        assert interval == self.hop_frames
+        assert len(levels) >= len(input) // interval + 1
+        return engine.loudness_process_decimated_buffer(self.state,
+            buffer_pointer(input, ctypes.c_float), len(input),
+            buffer_pointer(levels, ctypes.c_double))
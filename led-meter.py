@@ -6,6 +6,7 @@ to provide the final CLI.
 """
 
 import math
+import bisect
 
 
 # Simple math utilities
@@ -45,7 +46,7 @@ def to_decibel(value, limit=-70):
 
 def map_to_leds(sample, options):
     """
-    Map an amplitude measure (`sample`) into an integer, specifying how
+    Map an amplitude measure (`sample`) into a number, specifying how
     many LEDs should be turned on to represent that amplitude.
     `options` is a dictionary with the following keys:
 
@@ -56,10 +57,23 @@ def map_to_leds(sample, options):
       be between zero and `count`.
     - `should_round`: if true, the decibels will be rounded to the nearest
       number of LEDs instead of floored.
+    - `partial`: if true, the number isn't rounded nor floored, so that
+      the last LED can be lit partially (see `set_leds()`).
+
+    If the options have been passed to `prepare_map_options()`, the
+    amplitude is just looked up in a table, without any logarithm.
     """
+    thresholds = options.get("thresholds")
+    if thresholds is not None:
+        if options["ascending"]:
+            return bisect.bisect_right(thresholds, sample)
+        return len(thresholds) - bisect.bisect_left(thresholds, sample)
+
     db = to_decibel(sample)
     meter = clamp(nmap(db, fr=options["range"])) * options["count"]
 
+    if options.get("partial"):
+        return meter
     if options["should_round"]:
         meter = round(meter)
     else:
@@ -67,17 +81,245 @@ def map_to_leds(sample, options):
 
     return int(meter)
 
-def send_leds(client, leds, count):
+def map_levels_to_leds(levels, options):
+    """
+    Same as `map_to_leds()`, but maps a numpy array of amplitude
+    measures at once, returning an array.
+    """
+    import numpy as np
+    thresholds = options.get("thresholds")
+    if thresholds is None:
+        return np.array([map_to_leds(level, options) for level in levels], "d")
+    if options["ascending"]:
+        return np.searchsorted(thresholds, levels, side="right")
+    return len(thresholds) - np.searchsorted(thresholds, levels, side="left")
+
+def prepare_map_options(options, limit=-70):
+    """
+    Precompute, for the `map_to_leds()` options given, the amplitude at
+    which every LED turns on, so that mapping is a binary search. This
+    is done in place. `limit` is the one used by `to_decibel()`.
+    Doesn't apply to `partial` options, which need the exact measure.
+    """
+    if options.get("partial"):
+        return options
+    start, end = options["range"]
+    ascending = end > start
+    offset = 0.5 if options["should_round"] else 0
+
+    # LED k turns on when the mapped measure reaches k (or k - 0.5 if
+    # rounding), find the amplitude for that. Amplitudes below the limit
+    # count as the limit, so thresholds under it are always (or never) met.
+    thresholds = []
+    for k in xrange(1, options["count"] + 1):
+        db = nmap(float(k - offset) / options["count"], to=(start, end))
+        if (db <= limit) if ascending else (db < limit):
+            threshold = float("-inf")
+        else:
+            threshold = 10 ** (db / 10)
+        thresholds.append(threshold)
+
+    options["thresholds"] = sorted(thresholds)
+    options["ascending"] = ascending
+    return options
+
+class LedHold:
+    """
+    Steadies the LED counts of a meter, so that a level hovering around the
+    threshold of a LED doesn't turn it on and off every frame (each toggle
+    costs a packet, and writes on the device). It has two parts:
+
+    - Hysteresis: a LED turns on at its threshold, like in `map_to_leds()`,
+      but only turns off once the level is `hysteresis` dB below it.
+    - Hold: once on, a LED stays on for at least `hold_frames` frames.
     """
-    Given a LEDP client, a list of LEDs to turn on, and a count, turn the
+
+    def __init__(self, options, hysteresis=0, hold_frames=0):
+        """
+        Initialize the state, for a meter mapped with `options` (see
+        `map_to_leds()`) and the hysteresis (in dB) and hold given.
+        """
+        self.options = options
+        start, end = options["range"]
+        self.gain = 10 ** ((hysteresis if end >= start else -hysteresis) / 10.0)
+        self.hysteresis = hysteresis > 0
+        self.hold_frames = int(hold_frames)
+        self.held_until = [0] * options["count"]
+        self.frame = 0
+        self.count = 0
+
+    def map(self, sample):
+        """
+        Map an amplitude measure into a number of LEDs, like `map_to_leds()`,
+        but taking the previous ones into account. Call once per frame.
+        """
+        count = map_to_leds(sample, self.options)
+
+        # Going down, keep the LEDs that would still be on with the headroom
+        if self.hysteresis and count < self.count:
+            count = max(count, min(self.count, map_to_leds(sample * self.gain, self.options)))
+
+        # LEDs fully turned on now are held, and the highest one
+        # still held keeps the ones below it on too
+        if self.hold_frames:
+            self.frame += 1
+            on, lit = int(self.count), int(count)
+            for led in xrange(on, lit):
+                self.held_until[led] = self.frame + self.hold_frames
+            for led in xrange(on - 1, int(count) - 1, -1):
+                if self.held_until[led] > self.frame:
+                    count = led + 1
+                    break
+
+        self.count = count
+        return count
+
+def set_leds(client, leds, count):
+    """
+    Given a LEDP client, a list of LEDs to turn on, and a count, set the
     first `count` LEDs on, the rest off. No other LEDs are touched.
-    `count` is expected to be an integer between zero and `len(leds)`.
+    `count` is expected to be a number between zero and `len(leds)`. If it
+    isn't an integer, the LED after the full ones gets the fractional part
+    as its brightness level.
+    This does *not* send the command, see `send_leds()`.
     """
+    full = int(count)
     for level, led_id in enumerate(leds):
-        client.set_led(led_id, level < count)
+        if level == full and count > full:
+            client.set_level(led_id, round((count - full) * 255))
+        else:
+            client.set_led(led_id, level < count)
+
+def set_decay_leds(client, leds, count, rate):
+    """
+    Same as `set_leds()`, but the server takes the LEDs down on its own
+    (see `Client.set_decay()`), at `rate` LEDs per second. Every LED gets
+    a level above 255 with the number of LEDs lit above it, so that the
+    meter falls LED by LED. Only the peaks are actually sent.
+
+    Fully lit LEDs get one more LED of headroom, so that they stay lit
+    while the level holds, and a new peak is only sent once the meter
+    would have fallen by a whole LED.
+    """
+    for level, led_id in enumerate(leds):
+        height = count - level
+        if height >= 1: height += 1
+        client.set_decay(led_id, height * 255, rate * 255, 255)
+
+def send_leds(client, leds, count):
+    """
+    Same as `set_leds()`, but commits the changes to the device.
+    """
+    set_leds(client, leds, count)
     client.commit()
 
 
+# Meters following several channels
+
+def parse_channels(value, count):
+    """
+    Parse the channels a meter follows: a comma-separated list of channel
+    numbers (from 1), or `all`. `count` is the number of channels of
+    the input. Returns a list of channel indices (from 0).
+    """
+    if value == "all":
+        return range(count)
+    channels = [int(channel) - 1 for channel in value.split(",")]
+    if not all(0 <= channel < count for channel in channels):
+        raise Exception("meter follows channel %s, but there are %d channels" % (value, count))
+    return channels
+
+def mix_levels(levels, mix):
+    """
+    Combine the levels of the channels of a meter, which are in the last
+    axis of `levels` (a numpy array): `max` takes the loudest channel,
+    `rms` the root mean square of all of them. The emphasis can make levels
+    negative, these count as silence for `rms`.
+    """
+    import numpy as np
+    if mix == "max":
+        return levels.max(axis=-1)
+    if mix == "rms":
+        return np.sqrt(np.mean(np.square(np.maximum(levels, 0)), axis=-1))
+    raise Exception("invalid channel mix %s" % mix)
+
+def get_meter_levels(levels, meter):
+    """
+    Return the levels of a meter from the levels of all filters (in the
+    last axis of `levels`), combining those of its channels if it has many.
+    The meter's filters are the ones from `meter["start"]` to `meter["end"]`.
+    """
+    start, end = meter["start"], meter["end"]
+    if end - start == 1:
+        return levels[..., start]
+    return mix_levels(levels[..., start:end], meter["channel-mix"])
+
+
+# Creation of the audio filter of a meter
+
+def create_filter(meter, sample_rate, smooth_scale=1, smooth_decimated=False, filter_class=None):
+    """
+    Create a volume filter for a meter, from its options (a dictionary with
+    the long option names as keys, like a section of the config file).
+    If smoothing runs at the frame rate (`smooth_decimated`), `smooth_scale`
+    is the number of samples per frame. `filter_class` defaults to the
+    native filter if the engine is compiled.
+    """
+    import filters
+    from filters import VolumeFollowFilter, NativeVolumeFollowFilter, AttackReleaseFilter
+    if filter_class is None:
+        filter_class = NativeVolumeFollowFilter if filters.engine else VolumeFollowFilter
+    time_to_frames = lambda time: float(time) * sample_rate
+
+    envelope_cutoff_frequency = float(meter["envelope-cutoff"])
+    envelope_cutoff_frames = time_to_frames(1 / envelope_cutoff_frequency)
+
+    emphasis_opacity = float(meter["emphasis"])
+    emphasis_cutoff_frequency = float(meter["highpass"])
+    emphasis_cutoff_frames = time_to_frames(1 / emphasis_cutoff_frequency) / smooth_scale
+
+    smooth_attack_frames = time_to_frames(float(meter["attack"]) / 1000) / smooth_scale
+    smooth_attack_coefficient = AttackReleaseFilter.get_coefficient(smooth_attack_frames)
+    smooth_release_frames = time_to_frames(float(meter["release"]) / 1000) / smooth_scale
+    smooth_release_coefficient = AttackReleaseFilter.get_coefficient(smooth_release_frames)
+
+    band_start_frames = band_end_frames = None
+    if meter.get("band-start") is not None:
+        band_start_frames = time_to_frames(1 / float(meter["band-start"]))
+    if meter.get("band-end") is not None:
+        band_end_frames = time_to_frames(1 / float(meter["band-end"]))
+
+    return filter_class(
+        envelope_cutoff_frames,
+        emphasis_cutoff_frames, emphasis_opacity,
+        smooth_attack_coefficient, smooth_release_coefficient,
+        smooth_decimated, band_start_frames, band_end_frames
+    )
+
+def create_loudness_filter(meter, sample_rate, interval, filter_class=None):
+    """
+    Create a loudness filter (for the `rms` and `loudness` engines) for a
+    meter, from its options like `create_filter()`. Levels are given every
+    `interval` samples. `filter_class` defaults to the native filter if the
+    engine is compiled.
+    """
+    import filters
+    from filters import LoudnessFilter, NativeLoudnessFilter
+    if filter_class is None:
+        filter_class = NativeLoudnessFilter if filters.engine else LoudnessFilter
+    time_to_frames = lambda time: float(time) * sample_rate
+
+    window_frames = time_to_frames(float(meter["window"]) / 1000)
+    band_start_frames = band_end_frames = None
+    if meter.get("band-start") is not None:
+        band_start_frames = time_to_frames(1 / float(meter["band-start"]))
+    if meter.get("band-end") is not None:
+        band_end_frames = time_to_frames(1 / float(meter["band-end"]))
+
+    return filter_class(window_frames, interval, sample_rate if meter["engine"] == "loudness" else None,
+                        band_start_frames, band_end_frames)
+
+
 
 if __name__ == "__main__":
     __doc__ = """
@@ -85,6 +327,8 @@ LED-based JACK meter.
 
 Usage:
   led-meter.py [options] <hostname:port> <leds>
+  led-meter.py [options] --config <file>
+  led-meter.py [options] --input <file> [<leds>]
   led-meter.py (-h | --help)
   led-meter.py --version
 
@@ -93,6 +337,23 @@ Metering options:
   -s <db>, --map-start <db>  DB measure that maps to zero LEDs. [default: -18]
   -e <db>, --map-end <db>    DB measure that maps to all LEDs. [default: -4]
   --round                    Round the measure instead of flooring it.
+  --partial                  Light the last LED partially, with a brightness
+                             level (only sysfs-leds supports it for now).
+  --decimated-smoothing      Run the emphasis & smoothing stages once per
+                             frame instead of once per sample (cheaper).
+  --hysteresis <db>          Only turn a LED off once the level is this many
+                             DB below its threshold. [default: 0]
+  --hold <ms>                Keep every LED on for at least this time, once it
+                             turns on. [default: 0]
+  --server-release <ms>      Let the server take the LEDs down by itself, the
+                             whole meter in this time, so that only the peaks
+                             are sent (needs a server with LEDP version 5, and
+                             a low -r). [default: 0]
+  --config <file>            Read the meters to run from a file, see README.
+  --channel <list>           Input channels (from 1) the meter follows, comma-
+                             separated, or all. [default: 1]
+  --channel-mix <m>          How the levels of several channels are combined:
+                             max or rms. [default: max]
 
 Volume calculation options:
   -k <a>, --emphasis <e>     Opacity of the highpass (emphasis) filter. [default: 0.72]
@@ -100,9 +361,45 @@ Volume calculation options:
   -a <ms>, --attack <ms>     Half-attack time for volume smoothing. [default: 2]
   -r <ms>, --release <ms>    Half-release time for volume smoothing. [default: 70]
   --envelope-cutoff <hz>     Cutoff frequency for the envelope follower. [default: 30]
+  --engine <e>               How the volume is measured: envelope (the filters
+                             above), rms (power over a window), loudness
+                             (K-weighted power, in LUFS) or spectrum (power of
+                             a band of an FFT). [default: envelope]
+  --window <ms>              Window of the rms and loudness engines. [default: 400]
+  --fft-size <n>             Samples in the FFT of the spectrum engine, where
+                             each meter is the band from band-start to band-end
+                             of the same FFT. [default: 2048]
+  --band-start <hz>          Only follow frequencies above this one.
+  --band-end <hz>            Only follow frequencies below this one.
+
+Network options:
+  --redundancy <n>           Send each change in this many frames. [default: 2]
+  --keepalive <ms>           Resend the LED state if nothing has been sent
+                             in this time (0 to disable). [default: 1000]
+  --protocol <v>             LEDP version to use. Version 2 makes servers drop
+                             reordered messages. [default: 1]
+  --frames <n>               With version 2, repeat the last n LED states in
+                             every message, to recover from losses. [default: 4]
+
+Offline options:
+  --input <file>             Read audio from a WAV or raw file (- for stdin)
+                             instead of JACK, as fast as possible, and write the
+                             LED counts of every frame instead of sending them.
+                             Only the number of LEDs given matters.
+  --output <file>            Where to write the LED counts. [default: -]
+  --output-format <f>        csv, or binary (32-bit little-endian floats, one
+                             per meter, for every frame). [default: csv]
+  --raw-format <f>           Read raw samples of this format (s16, s32 or f32)
+                             instead of a WAV file.
+  --raw-rate <hz>            Sample rate of raw input. [default: 48000]
+  --raw-channels <n>         Channels of raw input (each can be metered through
+                             a meter's channel option). [default: 1]
 
 JACK options:
   -n <name>, --name <name>    JACK client name to use. [default: led-meter]
+  --inputs <n>                Number of input ports (channels). [default: 1]
+  --realtime                  Process audio in the JACK real-time thread
+                              (needs the native engine and librealtime.so).
 
 General options:
   -h, --help     Show this help message.
@@ -110,107 +407,368 @@ General options:
     """
 
     import numpy as np
-    import jack
+    import sys
+    import time
     import socket
+    import ConfigParser
     import ledp
-    from filters import VolumeFollowFilter, AttackReleaseFilter
+    import filters
+    from filters import VolumeFollowFilter, NativeVolumeFollowFilter
+    from filters import VolumeFollowBank, NativeVolumeFollowBank
+    import spectrum
 
     from docopt import docopt
     arguments = docopt(__doc__.strip(), version="led-meter 0.1")
 
-    # Create LEDP clients
-    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    sock.setblocking(False)
-    hosts = arguments["<hostname:port>"].split(",")
-    def create_client(host):
+    # Read meters: options that every meter can override in its
+    # section of the config file, otherwise taken from the command line
+    meter_options = ["map-start", "map-end", "round", "partial", "emphasis", "highpass",
+                     "attack", "release", "envelope-cutoff", "band-start", "band-end",
+                     "channel", "channel-mix", "engine", "window", "hysteresis", "hold",
+                     "server-release"]
+    defaults = dict((name, arguments["--" + name]) for name in meter_options)
+
+    if arguments["--config"]:
+        config = ConfigParser.RawConfigParser()
+        if not config.read(arguments["--config"]):
+            raise Exception("couldn't read config file")
+        meters = []
+        for section in config.sections():
+            meter = dict(defaults)
+            for name, value in config.items(section):
+                if name not in meter_options + ["servers", "leds"]:
+                    raise Exception("unknown option %s in meter %s" % (name, section))
+                meter[name] = value
+            for name in ["round", "partial"]:
+                if name in config.options(section):
+                    meter[name] = config.getboolean(section, name)
+            if "servers" not in meter or "leds" not in meter:
+                raise Exception("meter %s needs servers and leds" % section)
+            meters.append(meter)
+        if not meters:
+            raise Exception("no meters in config file")
+    else:
+        meters = [dict(defaults, servers=arguments["<hostname:port>"], leds=arguments["<leds>"])]
+    meter_names = config.sections() if arguments["--config"] else ["meter"]
+
+    # In offline mode, nothing is sent: meters only need their LED count
+    offline_mode = arguments["--input"] is not None
+    if offline_mode and not all(meter.get("leds") for meter in meters):
+        raise Exception("offline mode needs the LEDs of every meter")
+    if offline_mode and arguments["--output-format"] not in ("csv", "binary"):
+        raise Exception("invalid output format given")
+
+    # Create LEDP clients, one per server, shared by all meters
+    # so that their changes are merged into a single packet
+    clients = {}
+    redundancy = int(arguments["--redundancy"])
+    keepalive = float(arguments["--keepalive"]) / 1000 or None
+    version = int(arguments["--protocol"])
+    frames = int(arguments["--frames"]) if version == ledp.sequenced_protocol_version else 1
+    if version == ledp.sequenced_protocol_version and any(meter["partial"] for meter in meters):
+        raise Exception("brightness levels (--partial) need protocol version 1")
+    if version == ledp.sequenced_protocol_version and any(float(meter["server-release"]) for meter in meters):
+        raise Exception("server-side release needs protocol version 1")
+    def parse_host(host):
         host = host.split(":")
         if len(host) == 1:
-            return ledp.Client(sock, host[0])
+            return (host[0], ledp.default_port)
         elif len(host) == 2:
-            return ledp.Client(sock, host[0], int(host[1]))
-        raise Exception("invalid host given")
-    clients = map(create_client, hosts)
+            return (host[0], int(host[1]))
+        else:
+            raise Exception("invalid host given")
+
+    # Every server gets its own connected socket (resolved once, sending
+    # with a plain send), unless the native engine can send the messages
+    # of several servers in a single batch, through a shared socket
+    hosts = set() if offline_mode else \
+        set(parse_host(host) for meter in meters for host in meter["servers"].split(","))
+    sock = None
+    if len(hosts) > 1 and ledp.batch_engine is not None and version == ledp.protocol_version:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setblocking(False)
+    def create_client(host):
+        key = parse_host(host)
+        if key not in clients:
+            clients[key] = ledp.Client(sock, key[0], key[1], redundancy, keepalive, version, frames)
+        return clients[key]
 
     # Parse LED specification, create multiclient
-    leds = arguments["<leds>"].split(",")
-    client = clients[0]
-    ledtuples = []
-    for led in leds:
-        led = led.split(":", 1)
-        if len(led) >= 2:
-            client = clients[int(led.pop(0)) - 1]
-        ledtuples.append((client, int(led[0])))
-
-    client = ledp.MultiClient(ledtuples)
-    leds = range(len(ledtuples))
+    def create_multiclient(meter):
+        meter_clients = map(create_client, meter["servers"].split(","))
+        client = meter_clients[0]
+        ledtuples = []
+        for led in meter["leds"].split(","):
+            led = led.split(":", 1)
+            if len(led) >= 2:
+                client = meter_clients[int(led.pop(0)) - 1]
+            ledtuples.append((client, int(led[0])))
+        return ledp.MultiClient(ledtuples)
 
     # Setup JACK interface
-    jack.attach(arguments["--name"])
-    jack.register_port("input", jack.IsInput | jack.IsTerminal | jack.IsPhysical)
-    buffer_size = jack.get_buffer_size()
-    sample_rate = jack.get_sample_rate()
-
-    def buffer_size_callback():
-        raise Exception("buffer size changed and I can't take that")
-        exit(2)
-    #jack.set_buffer_size_callback(buffer_size_callback) #FIXME
-    def sample_rate_callback():
-        raise Exception("sample rate changed and I can't take that")
-        exit(2)
-    #jack.set_sample_rate_callback(sample_rate_callback) #FIXME
-
-    jack_input = np.zeros((1, buffer_size), 'f')
-    jack_output = np.zeros((0, buffer_size), 'f')
-    output_buffer = range(buffer_size)
-
-    # Setup LED mapping & scheduling
-    map_range = (float(arguments["--map-start"]), float(arguments["--map-end"]))
-    should_round = arguments["--round"]
-    map_options = {"range": map_range, "count": len(leds), "should_round": should_round}
-
+    realtime_mode = arguments["--realtime"]
+    if offline_mode:
+        # Audio comes from a file instead, read in large blocks
+        import audiofile
+        audio_input = audiofile.AudioInput(arguments["--input"], arguments["--raw-format"],
+                                           arguments["--raw-rate"], arguments["--raw-channels"])
+        buffer_size = audiofile.block_size
+        sample_rate = audio_input.sample_rate
+        channel_count = audio_input.channels
+        audio_buffer = np.zeros((channel_count, buffer_size), 'f')
+    elif realtime_mode:
+        # The native engine takes care of JACK
+        import realtime
+        if filters.engine is None:
+            raise Exception("real-time mode needs the native engine")
+        channel_count = int(arguments["--inputs"])
+        realtime_meter = realtime.RealtimeMeter(arguments["--name"], channel_count)
+        buffer_size = realtime_meter.buffer_size
+        sample_rate = realtime_meter.sample_rate
+    else:
+        import jack
+        jack.attach(arguments["--name"])
+        channel_count = int(arguments["--inputs"])
+        for channel in xrange(channel_count):
+            port_name = "input" if channel_count == 1 else "input_%d" % (channel + 1)
+            jack.register_port(port_name, jack.IsInput | jack.IsTerminal | jack.IsPhysical)
+        buffer_size = jack.get_buffer_size()
+        sample_rate = jack.get_sample_rate()
+
+        def buffer_size_callback():
+            raise Exception("buffer size changed and I can't take that")
+            exit(2)
+        #jack.set_buffer_size_callback(buffer_size_callback) #FIXME
+        def sample_rate_callback():
+            raise Exception("sample rate changed and I can't take that")
+            exit(2)
+        #jack.set_sample_rate_callback(sample_rate_callback) #FIXME
+
+        jack_input = np.zeros((channel_count, buffer_size), 'f')
+        jack_output = np.zeros((0, buffer_size), 'f')
+
+    # Setup scheduling
     frame_rate = float(arguments["--framerate"])
-    interval = int(round(sample_rate/frame_rate))
-
-    # Create the audio filter
-    time_to_frames = lambda time: float(time) * sample_rate
-
-    envelope_cutoff_frequency = float(arguments["--envelope-cutoff"])
-    envelope_cutoff_frames = time_to_frames(1 / envelope_cutoff_frequency)
-
-    emphasis_opacity = float(arguments["--emphasis"])
-    emphasis_cutoff_frequency = float(arguments["--highpass"])
-    emphasis_cutoff_frames = time_to_frames(1 / emphasis_cutoff_frequency)
-
-    smooth_attack_frames = time_to_frames(float(arguments["--attack"]) / 1000)
-    smooth_attack_coefficient = AttackReleaseFilter.get_coefficient(smooth_attack_frames)
-    smooth_release_frames = time_to_frames(float(arguments["--release"]) / 1000)
-    smooth_release_coefficient = AttackReleaseFilter.get_coefficient(smooth_release_frames)
-
-    volume_filter = VolumeFollowFilter(
-        envelope_cutoff_frames,
-        emphasis_cutoff_frames, emphasis_opacity,
-        smooth_attack_coefficient, smooth_release_coefficient
-    )
+    interval = max(1, int(round(sample_rate/frame_rate)))
+
+    # If smoothing runs at the frame rate, the frames
+    # for the emphasis & smoothing stages are scaled down.
+    smooth_decimated = arguments["--decimated-smoothing"]
+    smooth_scale = interval if smooth_decimated else 1
+
+    # Create the audio filter for a meter
+    if filters.engine is None:
+        print >> sys.stderr, "Native engine not compiled, falling back to the (slow) Python filters."
+    volume_filter_class = NativeVolumeFollowFilter if filters.engine else VolumeFollowFilter
+    volume_bank_class = NativeVolumeFollowBank if filters.engine else VolumeFollowBank
+
+    # Setup every meter: client, LEDs and mapping
+    for meter in meters:
+        if offline_mode:
+            meter["leds"] = range(len(meter["leds"].split(",")))
+        else:
+            meter["client"] = create_multiclient(meter)
+            meter["leds"] = range(len(meter["client"].leds))
+        map_range = (float(meter["map-start"]), float(meter["map-end"]))
+        meter["map_options"] = prepare_map_options({"range": map_range, "count": len(meter["leds"]),
+                                "should_round": meter["round"], "partial": meter["partial"]})
+        hysteresis, hold = float(meter["hysteresis"]), float(meter["hold"])
+        meter["hold_state"] = None
+        if hysteresis > 0 or hold > 0:
+            hold_frames = int(round(hold / 1000 * sample_rate / interval))
+            meter["hold_state"] = LedHold(meter["map_options"], hysteresis, hold_frames)
+        server_release = float(meter["server-release"]) / 1000
+        meter["decay_rate"] = len(meter["leds"]) / server_release if server_release > 0 else None
+        if meter["channel-mix"] not in ("max", "rms"):
+            raise Exception("invalid channel mix given")
+        if meter["engine"] not in ("envelope", "rms", "loudness", "spectrum"):
+            raise Exception("invalid engine given")
+    if realtime_mode and not all(meter["engine"] == "envelope" for meter in meters):
+        raise Exception("real-time mode only supports the envelope engine")
+
+    # Then, a filter (or a band of a spectrum analyzer) for each channel
+    # a meter follows. Its levels are the columns `start` to `end` of
+    # `levels`: first those of the envelope filters, then those of the
+    # loudness filters, then those of the bands.
+    meter_filters, loudness_filters = [], []
+    sources, loudness_sources = [], []
+    spectrum_bands = {} # channel -> list of (band, column)
+    ordered_meters = ([meter for meter in meters if meter["engine"] == "envelope"] +
+                      [meter for meter in meters if meter["engine"] in ("rms", "loudness")] +
+                      [meter for meter in meters if meter["engine"] == "spectrum"])
+    column = 0
+    for meter in ordered_meters:
+        channels = parse_channels(meter["channel"], channel_count)
+        meter["start"], meter["end"] = column, column + len(channels)
+        for channel in channels:
+            if meter["engine"] == "envelope":
+                meter_filters.append(create_filter(meter, sample_rate, smooth_scale,
+                                                   smooth_decimated, volume_filter_class))
+            elif meter["engine"] == "spectrum":
+                band = spectrum.SpectrumAnalyzer.get_band(sample_rate, interval,
+                    float(meter["band-start"]) if meter["band-start"] is not None else None,
+                    float(meter["band-end"]) if meter["band-end"] is not None else None,
+                    float(meter["attack"]) / 1000, float(meter["release"]) / 1000)
+                spectrum_bands.setdefault(channel, []).append((band, column))
+                column += 1
+                continue
+            else:
+                loudness_filters.append(create_loudness_filter(meter, sample_rate, interval))
+                loudness_sources.append(channel)
+                column += 1
+                continue
+            sources.append(channel)
+            column += 1
+
+    levels_length = realtime.max_read_frames if realtime_mode else buffer_size // interval + 1
+    levels = np.zeros((levels_length, column), 'd')
+
+    # A spectrum analyzer for every channel with bands, all bands
+    # of a channel come from the same FFT
+    spectrum_analyzers = []
+    for channel, bands in sorted(spectrum_bands.items()):
+        analyzer = spectrum.SpectrumAnalyzer(sample_rate, int(arguments["--fft-size"]),
+                                             interval, [band for band, column in bands])
+        columns = [column for band, column in bands]
+        spectrum_analyzers.append((analyzer, channel, columns, np.zeros((levels_length, len(bands)), 'd')))
+
+    # Commit all servers together, in a single batch
+    servers_client = ledp.MultiClient([], clients.values())
+
+    # All envelope meters (and channels) are processed together, in one pass,
+    # directly from the JACK buffers (the bank binds to them once, no copies
+    # are made). The vectorized bank only takes native envelope filters, so
+    # the loudness filters are run one after another, in a bank of their own.
+    if not all(isinstance(filter, NativeVolumeFollowFilter) for filter in meter_filters):
+        volume_bank_class = VolumeFollowBank
+    volume_bank = volume_bank_class(meter_filters) if meter_filters else None
+    bank_levels = levels if levels.shape[1] == len(meter_filters) else np.zeros((levels_length, len(meter_filters)), 'd')
+    loudness_bank = VolumeFollowBank(loudness_filters) if loudness_filters else None
+    loudness_levels = np.zeros((levels_length, len(loudness_filters)), 'd')
+    loudness_start = len(meter_filters)
+
+    def get_inputs(buffer):
+        """
+        Return the inputs of the envelope bank and those of the loudness
+        bank, from the rows (channels) of `buffer`.
+        """
+        return [buffer[channel] for channel in sources], [buffer[channel] for channel in loudness_sources]
+
+    def process_levels(inputs, channel_inputs):
+        """
+        Process a buffer with the banks (reading the lists of `inputs`, from
+        `get_inputs()`) and the spectrum analyzers (reading the rows of
+        `channel_inputs`), storing the levels into `levels`. Returns the
+        number of frames stored.
+        """
+        frames = 0
+        for analyzer, channel, columns, analyzer_levels in spectrum_analyzers:
+            frames = analyzer.process_decimated(channel_inputs[channel], interval, analyzer_levels)
+            levels[:frames, columns] = analyzer_levels[:frames]
+        if loudness_bank is not None:
+            frames = loudness_bank.process_decimated(inputs[1], interval, loudness_levels)
+            levels[:frames, loudness_start:loudness_start+len(loudness_filters)] = loudness_levels[:frames]
+        if volume_bank is not None:
+            frames = volume_bank.process_decimated(inputs[0], interval, bank_levels)
+            if bank_levels is not levels:
+                levels[:frames, :len(meter_filters)] = bank_levels[:frames]
+        return frames
+
+    if offline_mode:
+        # Process the whole input, writing the LED counts of every frame
+        output = sys.stdout if arguments["--output"] == "-" else open(arguments["--output"], "wb")
+        binary_output = arguments["--output-format"] == "binary"
+        if not binary_output:
+            output.write("time,%s\n" % ",".join(meter_names))
+        inputs = get_inputs(audio_buffer)
+        frame_index = 0
+        changes, last_counts = 0, np.zeros(len(meters), '<f4')
+        start = time.time()
+        try:
+            while True:
+                length = audio_input.read_channels_into(audio_buffer)
+                if not length: break
+                channel_inputs = audio_buffer
+                if length < buffer_size:
+                    channel_inputs = audio_buffer[:, :length]
+                    inputs = get_inputs(channel_inputs)
+                frames = process_levels(inputs, channel_inputs)
+                counts = np.empty((frames, len(meters)), '<f4')
+                for m, meter in enumerate(meters):
+                    meter_levels = get_meter_levels(levels[:frames], meter)
+                    if meter["hold_state"] is None:
+                        counts[:, m] = map_levels_to_leds(meter_levels, meter["map_options"])
+                    else:
+                        counts[:, m] = [meter["hold_state"].map(level) for level in meter_levels]
+                if frames:
+                    changes += (counts[0] != last_counts).sum() + (counts[1:] != counts[:-1]).sum()
+                    last_counts = counts[frames - 1].copy()
+                if binary_output:
+                    output.write(counts.tostring())
+                else:
+                    for i in xrange(frames):
+                        frame_time = (frame_index + i + 1) * interval / float(sample_rate)
+                        output.write("%.6f,%s\n" % (frame_time, ",".join("%g" % count for count in counts[i])))
+                frame_index += frames
+        except KeyboardInterrupt, e:
+            pass
+        elapsed = time.time() - start
+        output.flush()
+
+        duration = audio_input.get_duration()
+        print >> sys.stderr, "Processed %.1fs of audio (%d frames) in %.1fs, %.1fx real time." % (
+            duration, frame_index, elapsed, duration / max(elapsed, 1e-9))
+        print >> sys.stderr, "LED count changes: %d (%.1f per second)." % (changes, changes / max(duration, 1e-9))
+        exit(0)
 
     # Begin processing audio
-    jack.activate()
+    if realtime_mode:
+        realtime_meter.start(volume_bank, interval, sources)
+    else:
+        inputs = get_inputs(jack_input)
+        jack.activate()
 
     try:
         while True:
-            try:
-                jack.process(jack_output, jack_input)
-                input_buffer = jack_input[0].tolist()
-                for i in xrange(buffer_size):
-                    output_buffer[i] = volume_filter.process(input_buffer[i])
-            except jack.InputSyncError, e:
-                print "JACK: we couldn't process data in time."
-
-            count = map_to_leds(output_buffer[0], map_options) # TODO: respect -f
-            send_leds(client, leds, count)
+            if realtime_mode:
+                frames = realtime_meter.read(levels)
+            else:
+                try:
+                    jack.process(jack_output, jack_input)
+                    frames = process_levels(inputs, jack_input)
+                except jack.InputSyncError, e:
+                    print "JACK: we couldn't process data in time."
+                    frames = 0
+
+            # Send one update for every interval that has elapsed,
+            # with a single packet for each server
+            for i in xrange(frames):
+                for m, meter in enumerate(meters):
+                    level = get_meter_levels(levels[i], meter)
+                    if meter["hold_state"] is None:
+                        count = map_to_leds(level, meter["map_options"])
+                    else:
+                        count = meter["hold_state"].map(level)
+                    if meter["decay_rate"] is None:
+                        set_leds(meter["client"], meter["leds"], count)
+                    else:
+                        set_decay_leds(meter["client"], meter["leds"], count, meter["decay_rate"])
+                servers_client.commit()
     except KeyboardInterrupt, e:
         pass
 
+    # Print statistics
+    sent, suppressed = servers_client.get_stats()
+    print "Packets sent: %d, suppressed: %d" % (sent, suppressed)
+
     # Close everything
-    jack.deactivate()
-    jack.detach()
-    sock.close()
+    if realtime_mode:
+        print "Frames dropped by the real-time thread: %d" % realtime_meter.get_overruns()
+        realtime_meter.close()
+    else:
+        jack.deactivate()
+        jack.detach()
+    for client in clients.values():
+        client.close()
+    if sock is not None:
+        sock.close()
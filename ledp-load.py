@@ -0,0 +1,211 @@
+#!/usr/bin/python
+"""
+Load generator for LEDP servers. Sends LEDP messages at increasing rates,
+asking the server to echo them (see `servers/server.h`), and reports the
+packet loss and latency at each rate, so that the throughput ceiling of
+a server (and its backend) can be found on the real device.
+"""
+
+import time
+import errno
+import random
+import select
+import socket
+import ledp
+
+
+# LED patterns, taking the message number and the mask of LEDs to drive
+
+def pattern_counter(i, mask):
+    return i & mask
+
+def pattern_toggle(i, mask):
+    return mask if i % 2 else 0
+
+def pattern_random(i, mask):
+    return random.getrandbits(32) & mask
+
+def pattern_meter(i, mask):
+    count = bin(mask).count("1")
+    level = abs(i % (2 * count) - count)
+    return ((1 << level) - 1) & mask
+
+patterns = {
+    "counter": pattern_counter,
+    "toggle": pattern_toggle,
+    "random": pattern_random,
+    "meter": pattern_meter,
+}
+
+
+def percentile(values, fraction):
+    """
+    Return the given percentile (as a fraction) of
+    a sorted list of values, or None if it's empty.
+    """
+    if not values: return None
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+class LoadRun:
+    """
+    Results of sending messages at a certain rate.
+    """
+
+    def __init__(self, rate):
+        self.rate = rate
+        self.sent = 0
+        self.elapsed = 0
+        self.pending = {} # token -> time sent
+        self.echoes = 0
+        self.round_trips = []
+        self.writes = []
+
+    def get_loss(self):
+        """
+        Return the fraction of echoes that didn't arrive.
+        """
+        if not self.echoes: return 0
+        return len(self.pending) / float(self.echoes)
+
+    def receive_replies(self, sock, timeout):
+        """
+        Wait up to `timeout` seconds for replies, then
+        process all of the queued ones.
+        """
+        if not select.select([sock], [], [], max(0, timeout))[0]:
+            return
+        while True:
+            try:
+                reply = sock.recv(64)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK): return
+                raise
+            now = time.time()
+            echo = ledp.parse_echo_reply(reply)
+            if echo is None or echo[0] not in self.pending: continue
+            token, received, written = echo
+            self.round_trips.append(now - self.pending.pop(token))
+            self.writes.append((written - received) / 1e9)
+
+def run_load(client, pattern, mask, rate, duration, echo_every, drain=1.0):
+    """
+    Send messages through `client` at `rate` messages per second for
+    `duration` seconds, waiting up to `drain` seconds for the last echoes.
+    Returns a `LoadRun`.
+    """
+    run = LoadRun(rate)
+    sock, period = client.sock, 1.0 / rate
+    start = time.time()
+    next_send = start
+
+    while True:
+        now = time.time()
+        if now - start >= duration: break
+        if now >= next_send:
+            token = None
+            if run.sent % echo_every == 0:
+                token = run.sent
+                run.pending[token] = now
+                run.echoes += 1
+            values = pattern(run.sent, mask)
+            if client.version == ledp.protocol_version:
+                client.send_raw(mask, values, token)
+            else:
+                client.sequence = (client.sequence + 1) & 0xFFFFFFFF
+                client.send_sequenced(client.sequence, [(mask, values)], token)
+            run.sent += 1
+            next_send += period
+        run.receive_replies(sock, next_send - time.time())
+    run.elapsed = time.time() - start
+
+    deadline = time.time() + drain
+    while run.pending and time.time() < deadline:
+        run.receive_replies(sock, deadline - time.time())
+    return run
+
+def report_run(run):
+    """
+    Print the results of a run as a table row.
+    """
+    round_trips, writes = sorted(run.round_trips), sorted(run.writes)
+    ms = lambda value: "%8.3f" % (value * 1e3) if value is not None else "       -"
+    print "  %8d %10.1f %6.2f%%  %s %s  %s %s" % (
+        run.rate, run.sent / run.elapsed, run.get_loss() * 100,
+        ms(percentile(round_trips, 0.5)), ms(percentile(round_trips, 0.99)),
+        ms(percentile(writes, 0.5)), ms(percentile(writes, 0.99)))
+
+
+
+if __name__ == "__main__":
+    __doc__ = """
+LEDP load generator. Sends messages to a LEDP server at each of the given
+rates, and reports:
+
+ - The rate actually achieved (this script may not keep up with high rates).
+ - The percentage of messages lost.
+ - The p50 and p99 round-trip time in milliseconds, from sending a message
+   to receiving the server's answer, which is sent after the LEDs are written.
+ - The p50 and p99 server-side write time in milliseconds, from receiving
+   the message to writing the LEDs (for wiimote, until the update is queued).
+
+The throughput ceiling is the highest rate with acceptable loss.
+
+Usage:
+  ledp-load.py [options] <hostname:port>
+  ledp-load.py (-h | --help)
+
+Options:
+  -r <list>, --rates <list>    Comma-separated list of rates to try, in messages
+                               per second. [default: 100,1000,5000,10000,20000]
+  -d <s>, --duration <s>       Seconds to send at each rate. [default: 5]
+  -p <name>, --pattern <name>  LED pattern: counter, toggle, random or meter. [default: meter]
+  -l <n>, --leds <n>           How many LEDs to drive, starting at LED 0. [default: 8]
+  -e <n>, --echo-every <n>     Ask for an echo in one of every n messages. [default: 1]
+  --max-loss <percent>         Loss allowed at the throughput ceiling. [default: 1]
+  --protocol <v>               LEDP version to use (1 or 2). [default: 1]
+    """
+
+    from docopt import docopt
+    arguments = docopt(__doc__.strip())
+
+    # Create client
+    host = arguments["<hostname:port>"].split(":")
+    if len(host) > 2:
+        raise Exception("invalid host given")
+    port = int(host[1]) if len(host) == 2 else ledp.default_port
+    client = ledp.Client(None, host[0], port, version=int(arguments["--protocol"]))
+
+    # Parse options
+    pattern = patterns.get(arguments["--pattern"])
+    if pattern is None:
+        raise Exception("invalid pattern given")
+    leds = int(arguments["--leds"])
+    if not (0 < leds <= 32):
+        raise Exception("invalid number of LEDs given")
+    mask = (1 << leds) - 1
+    rates = [int(rate) for rate in arguments["--rates"].split(",")]
+    duration = float(arguments["--duration"])
+    echo_every = int(arguments["--echo-every"])
+    max_loss = float(arguments["--max-loss"]) / 100
+
+    # Run at every rate
+    print "  %8s %10s %7s  %8s %8s  %8s %8s" % ("rate", "achieved", "loss",
+        "rtt p50", "rtt p99", "wr p50", "wr p99")
+    ceiling = None
+    try:
+        for rate in rates:
+            run = run_load(client, pattern, mask, rate, duration, echo_every)
+            report_run(run)
+            if run.get_loss() <= max_loss and run.echoes:
+                ceiling = max(ceiling, run.sent / run.elapsed)
+    except KeyboardInterrupt:
+        pass
+
+    if ceiling is None:
+        print "Throughput ceiling: below the rates tried"
+    else:
+        print "Throughput ceiling: at least %.0f messages/s" % ceiling
+
+    # Turn the LEDs off and close
+    client.send_raw(mask, 0)
+    client.close()
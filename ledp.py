@@ -1,56 +1,339 @@
 #!/usr/bin/python
 """
 This module implements a LEDP client. The single class exported has
-a low-level, stateless method to send a single message (`send_raw`),
-and high-level methods (`sed_led`, `release_led`, `reset` and `commit`).
+low-level, stateless methods to send a single message (`send_raw`,
+`send_sequenced`, `send_bitmap`, `send_levels` and `send_decay`), and
+high-level methods (`sed_led`, `set_level`, `set_decay`, `release_led`,
+`reset` and `commit`).
 """
 
+import os
+import time
+import errno
+import socket
+import random
 import struct
+import select
+import collections
+import ctypes
+import native
 
 protocol_version = 1
+sequenced_protocol_version = 2
+bitmap_protocol_version = 3
+levels_protocol_version = 4
+decay_protocol_version = 5
+max_frames = 8 # MAX_FRAMES in servers/server.h
+max_leds = 512 # MAX_LEDS in servers/server.h
 default_port = 5021
+max_batch_servers = 64 # MAX_BATCH_SERVERS in engine/batch.h
+echo_reply_size = 24
+stats_request = "S"
+stats_size = 8192 # STATS_SIZE in servers/server.h
+names_request = "N"
+names_size = 16384 # NAMES_SIZE in servers/server.h
+
+# Largest message a client builds: a version 5 one with all words and LEDs
+max_packet_size = 3 + 4 * (max_leds // 32) + 4 * max_leds + 8
+
+# Highest level and rate of a decaying LED (see `set_decay`), and how far
+# above the level the server should be at a new one has to be to be sent
+max_decay_level = 0xFFFF
+max_decay_rate = 0xFFFF
+decay_tolerance = 32
+
+# Precompiled layouts of the message parts
+header_v1 = struct.Struct("!BII")
+header_v2 = struct.Struct("!BIIB")
+header_words = struct.Struct("!BBB")
+frame_layout = struct.Struct("!II")
+mask_layout = struct.Struct("!I")
+echo_layout = struct.Struct("!Q")
+decay_layout = struct.Struct("!HH")
 
 class Client:
     """
     Encodes and sends LEDP messages over a given socket.
     """
 
-    def __init__(self, sock, hostname, port=default_port):
+    def __init__(self, sock, hostname, port=default_port,
+                 redundancy=1, keepalive=None, version=protocol_version, frames=1):
         """
-        Initializes a LEDP client that will send messages through the
-        user-supplied socket `sock`, which is expected to be in datagram mode.
-        Messages will be sent to `hostname` and `port`.
+        Initializes a LEDP client that will send messages to `hostname` and
+        `port`, which are resolved once, here. If `sock` is None, the client
+        creates its own datagram socket, connected to the server (see
+        `close()`), otherwise messages are sent through the user-supplied
+        one, which is expected to be in datagram mode and can be shared by
+        many clients (see `MultiClient`).
+
+        Messages are built into a buffer allocated once, so sending one
+        doesn't create any objects but a view of it.
+
+        `commit()` only sends messages when the state changes. Each change
+        is sent in the next `redundancy` commits, and if `keepalive` is set,
+        the state is resent if no message has been sent in that many seconds,
+        so that the device recovers from lost packets.
+
+        If `version` is 2, messages are numbered so that the server drops
+        reordered ones, and repeat the last `frames` states, so that a lost
+        message is recovered by the next one.
+
+        Version 1 clients can use up to `max_leds` LEDs: if LEDs above 31
+        are set, version 3 messages (with a variable-length bitmap) are
+        sent instead. Brightness levels (see `set_level`) are sent with
+        version 4 messages, and decaying LEDs (see `set_decay`) with version
+        5 ones. Version 2 is limited to 32 on/off LEDs.
         """
-        self.sock = sock
+        if version not in (protocol_version, sequenced_protocol_version):
+            raise Exception("unknown protocol version %d" % version)
+        if not (1 <= frames <= max_frames):
+            raise Exception("invalid number of frames %d" % frames)
         self.hostname = hostname
         self.port = port
+        family = sock.family if sock is not None else socket.AF_INET
+        family, _, _, _, self.address = socket.getaddrinfo(hostname, port, family, socket.SOCK_DGRAM)[0]
+        self.connected = sock is None
+        if self.connected:
+            sock = socket.socket(family, socket.SOCK_DGRAM)
+            sock.connect(self.address)
+            sock.setblocking(False)
+        self.sock = sock
+        self.packet = bytearray(max_packet_size)
+        self.view = memoryview(self.packet)
         self.mask = int(0)
         self.values = int(0)
+        self.levels = {}
+        self.decays = {}
 
-    def send_raw(self, mask, values):
+        self.redundancy = redundancy
+        self.keepalive = keepalive
+        self.last_state = None
+        self.last_sent = 0
+        self.resends = 0
+        self.packets_sent = 0
+        self.packets_suppressed = 0
+
+        self.version = version
+        self.sequence = random.getrandbits(32)
+        self.frames = collections.deque(maxlen=frames)
+
+    def send_raw(self, mask, values, echo=None):
         """
         Low-level method. Encodes and sends a LEDP message
         with `mask` and `values` supplied.
+
+        If an `echo` token (a 64-bit integer) is given, the server will
+        answer with the token and the times the message was received and
+        the LEDs were written, see `parse_echo_reply`.
         """
-        packet = struct.pack("!BII", protocol_version, mask, values)
-        self.sock.sendto(packet, (self.hostname, self.port))
+        header_v1.pack_into(self.packet, 0, protocol_version, mask, values)
+        self.send_packet(header_v1.size, echo)
+
+    def send_packet(self, size, echo=None):
+        """
+        Low-level method. Sends the first `size` bytes of the message
+        buffer, followed by the `echo` token if there is one.
+        """
+        if echo is not None:
+            echo_layout.pack_into(self.packet, size, echo)
+            size += echo_layout.size
+        try:
+            if self.connected:
+                self.sock.send(self.view[:size])
+            else:
+                self.sock.sendto(self.view[:size], self.address)
+        except socket.error as e:
+            # A connected socket reports the ICMP errors of earlier messages
+            # (i.e. when the server isn't running yet), these aren't fatal
+            if not (self.connected and e.errno == errno.ECONNREFUSED):
+                raise
+
+    def send_state(self, mask, values, levels=(), decays=()):
+        """
+        Send a version 1 message, a version 3 one if there are LEDs above 31,
+        a version 4 one if there are `levels` (a list of (id, level) tuples),
+        or a version 5 one if there are `decays` (a list of (id, peak) tuples,
+        see `set_decay`), with the levels they should be at now.
+        """
+        if decays:
+            now = time.time()
+            current = dict((id, (int(round(get_decayed_level(peak, now))), peak[1])) for id, peak in decays)
+            self.send_decay(mask, values, dict(levels), current)
+        elif levels:
+            self.send_levels(mask, values, dict(levels))
+        elif mask >> 32:
+            self.send_bitmap(mask, values)
+        else:
+            self.send_raw(mask, values)
+
+    def send_sequenced(self, sequence, frames, echo=None):
+        """
+        Low-level method. Encodes and sends a version 2 LEDP message
+        with the (mask, values) `frames` supplied, oldest first, where
+        the first frame has number `sequence`. See `send_raw` for `echo`.
+        """
+        timestamp = int(time.time() * 1000) & 0xFFFFFFFF
+        header_v2.pack_into(self.packet, 0, sequenced_protocol_version,
+            sequence & 0xFFFFFFFF, timestamp, len(frames))
+        size = header_v2.size
+        for mask, values in frames:
+            frame_layout.pack_into(self.packet, size, mask, values)
+            size += frame_layout.size
+        self.send_packet(size, echo)
+
+    def send_bitmap(self, mask, values, echo=None):
+        """
+        Low-level method. Encodes and sends a version 3 LEDP message, which
+        can have LEDs above 31, with `mask` and `values` supplied. Only the
+        range of 32-LED words having bits in `mask` is sent. See `send_raw`
+        for `echo`.
+        """
+        first, last = get_word_range(mask)
+        header_words.pack_into(self.packet, 0, bitmap_protocol_version, first, last - first + 1)
+        size = header_words.size
+        for word in xrange(first, last + 1):
+            frame_layout.pack_into(self.packet, size, (mask >> (32 * word)) & 0xFFFFFFFF,
+                (values >> (32 * word)) & 0xFFFFFFFF)
+            size += frame_layout.size
+        self.send_packet(size, echo)
+
+    def send_levels(self, mask, values, levels, echo=None):
+        """
+        Low-level method. Encodes and sends a version 4 LEDP message, which
+        sets the LEDs in `mask` to brightness levels: the LEDs that are a key
+        of the `levels` dictionary to its value (0 to 255), the rest fully on
+        or off depending on `values`. See `send_raw` for `echo`.
+        """
+        first, last = get_word_range(mask)
+        header_words.pack_into(self.packet, 0, levels_protocol_version, first, last - first + 1)
+        size = header_words.size
+        for word in xrange(first, last + 1):
+            mask_layout.pack_into(self.packet, size, (mask >> (32 * word)) & 0xFFFFFFFF)
+            size += mask_layout.size
+        for id in xrange(32 * first, 32 * (last + 1)):
+            if (mask >> id) & 1:
+                self.packet[size] = levels.get(id, 255 if (values >> id) & 1 else 0)
+                size += 1
+        self.send_packet(size, echo)
+
+    def send_decay(self, mask, values, levels, decays, echo=None):
+        """
+        Low-level method. Encodes and sends a version 5 LEDP message, which
+        makes the server take LEDs down on its own. The LEDs in `mask` that
+        are a key of the `decays` dictionary go down from its value, a
+        (level, rate) tuple: the level now (0 to `max_decay_level`, shown up
+        to 255) and how many levels per second it goes down. The rest are
+        set like in `send_levels`. See `send_raw` for `echo`.
+        """
+        first, last = get_word_range(mask)
+        header_words.pack_into(self.packet, 0, decay_protocol_version, first, last - first + 1)
+        size = header_words.size
+        for word in xrange(first, last + 1):
+            mask_layout.pack_into(self.packet, size, (mask >> (32 * word)) & 0xFFFFFFFF)
+            size += mask_layout.size
+        for id in xrange(32 * first, 32 * (last + 1)):
+            if (mask >> id) & 1:
+                level, rate = decays.get(id) or (levels.get(id, 255 if (values >> id) & 1 else 0), 0)
+                decay_layout.pack_into(self.packet, size, level, rate)
+                size += decay_layout.size
+        self.send_packet(size, echo)
+
+    def request_stats(self, timeout=1.0):
+        """
+        Ask the server for its counters, waiting up to `timeout` seconds for
+        the answer. Returns a dictionary from the counter name to its value
+        (a string), or None if no answer came.
+        """
+        return self.request_text(stats_request, stats_size, timeout)
+
+    def request_names(self, timeout=1.0):
+        """
+        Ask the server for the names of its LEDs, see `request_stats`.
+        Returns a dictionary from the LED id to its name. Servers that
+        don't name their LEDs answer with an empty one.
+        """
+        names = self.request_text(names_request, names_size, timeout)
+        return dict((int(id), name) for id, name in names.iteritems()) if names is not None else None
+
+    def request_text(self, request, size, timeout):
+        """
+        Low-level method. Send a single-byte `request`, and parse the text
+        answer (up to `size` bytes) as a dictionary, from the first word of
+        every line to the rest of it. Returns None if no answer came.
+        """
+        self.packet[0] = ord(request)
+        self.send_packet(len(request))
+        if not select.select([self.sock], [], [], timeout)[0]:
+            return None
+        try:
+            reply = self.sock.recv(size)
+        except socket.error as e:
+            if e.errno != errno.ECONNREFUSED: raise
+            return None
+        return dict(line.split(" ", 1) if " " in line else (line, "")
+                    for line in reply.splitlines())
 
     def set_led(self, id, value):
         """
         Acquire and set a LED to a state.
         This does *not* send the command, see `commit()`.
         """
+        limit = 32 if self.version == sequenced_protocol_version else max_leds
+        if not (0 <= id < limit):
+            raise Exception("invalid LED %d" % id)
         self.mask |= (1 << id)
         if value:
             self.values |= (1 << id)
         else:
             self.values &= ~(1 << id)
+        if self.levels:
+            self.levels.pop(id, None)
+        if self.decays:
+            self.decays.pop(id, None)
+
+    def set_level(self, id, level):
+        """
+        Acquire and set a LED to a brightness level, from 0 (off) to 255
+        (fully on). Servers that can't dim LEDs turn them on from 128 on.
+        This does *not* send the command, see `commit()`.
+        """
+        level = int(level)
+        if level <= 0 or level >= 255:
+            return self.set_led(id, level > 0)
+        if self.version == sequenced_protocol_version:
+            raise Exception("version 2 doesn't support brightness levels")
+        self.set_led(id, level >= 128)
+        self.levels[id] = level
+
+    def set_decay(self, id, level, rate, tolerance=decay_tolerance):
+        """
+        Acquire a LED and let the server take it down on its own: it's at
+        `level` now (0 to `max_decay_level`, shown up to 255), and goes down
+        by `rate` levels per second. The server only takes levels above the
+        current one, so this only changes the state (and sends a message)
+        for peaks: levels more than `tolerance` above the one the server
+        should be at by now, or a different rate.
+        This does *not* send the command, see `commit()`.
+        """
+        if self.version == sequenced_protocol_version:
+            raise Exception("version 2 doesn't support decaying LEDs")
+        level = int(min(max(level, 0), max_decay_level))
+        rate = int(min(max(rate, 0), max_decay_rate))
+        now = time.time()
+        peak = self.decays.get(id)
+        if peak is not None and peak[1] == rate and (self.mask >> id) & 1 and \
+           level <= get_decayed_level(peak, now) + tolerance:
+            return
+        self.set_led(id, level >= 128)
+        self.decays[id] = (level, rate, now)
 
     def release_led(self, id):
         """
         Release a LED. Future commits won't change the value of this LED.
         """
         self.mask &= ~(1 << id)
+        self.levels.pop(id, None)
+        self.decays.pop(id, None)
 
     def reset(self):
         """
@@ -59,37 +342,118 @@ class Client:
         new instance.
         """
         self.mask = int(0)
+        self.levels = {}
+        self.decays = {}
+
+    def close(self):
+        """
+        Close the socket, if the client created it.
+        """
+        if self.connected:
+            self.sock.close()
 
-    def commit(self):
+    def commit(self, force=False):
         """
         Send a LEDP message to the device to update the state of the LEDs
         that have been touched via `set_led()` at least once.
 
-        You may want to call this method multiple times to resend the message,
-        just in case some packets get lost.
+        The message is only sent if the state changed since the last one,
+        or if a resend is due (see the constructor). Pass `force` to send
+        it anyway, i.e. to resend it just in case some packets get lost.
         """
-        self.send_raw(self.mask, self.values)
+        state = self.prepare_commit(force)
+        if state is None:
+            return
+        if self.version == protocol_version:
+            self.send_state(*state)
+        else:
+            self.send_sequenced(self.sequence - len(self.frames) + 1, self.frames)
+
+    def prepare_commit(self, force=False):
+        """
+        Does the work of `commit()`, but instead of sending the message,
+        returns the (mask, values, levels, decays) to send, or None if no
+        message is due. `levels` is a tuple of (id, level) for LEDs with a
+        brightness level, and `decays` of (id, peak) for decaying ones.
+        """
+        levels = tuple(sorted(self.levels.iteritems())) if self.levels else ()
+        decays = tuple(sorted(self.decays.iteritems())) if self.decays else ()
+        state = (self.mask, self.values & self.mask, levels, decays)
+        now = time.time()
+        if state != self.last_state:
+            self.last_state = state
+            self.resends = self.redundancy
+            self.sequence = (self.sequence + 1) & 0xFFFFFFFF
+            self.frames.append(state[:2])
+        elif not (force or self.resends):
+            keepalive = self.keepalive
+            if keepalive is None or now - self.last_sent < keepalive:
+                self.packets_suppressed += 1
+                return None
+
+        self.resends = max(0, self.resends - 1)
+        self.last_sent = now
+        self.packets_sent += 1
+        return state
+
+    def cancel_commit(self):
+        """
+        Undo the accounting of the last `prepare_commit()`, when its message
+        couldn't be sent, so that the next commit sends the state again.
+        """
+        self.last_state = None
+        self.packets_sent -= 1
 
 class MultiClient:
     """
     This has the same interface as `Client` (except `raw_send`), but allows one
     to join multiple clients into a single, virtual one and delegates calls
     to them.
+
+    If the native engine is available and all clients share a socket (and
+    use version 1), the messages of all clients are sent with a single
+    `sendmmsg()` call. Clients with their own, connected socket send
+    their messages one by one.
     """
 
-    def __init__(self, leds):
+    def __init__(self, leds, clients=()):
         """
         Create a multiclient. `leds` is expected to be a list of (client, led)
         tuples where `client` is a LEDP client and `led` is the id of the LED to
-        set in that client.
+        set in that client. Additional `clients` to commit can also be given.
         """
         self.leds = leds
-        self.clients = set(client for client, led in leds)
+        self.clients = list(set(client for client, led in leds) | set(clients))
+
+        # Prepare the batch for the clients, if possible
+        self.batch = None
+        sockets = set(client.sock for client in self.clients)
+        versions = set(client.version for client in self.clients)
+        connected = any(client.connected for client in self.clients)
+        if batch_engine is not None and len(sockets) == 1 and not connected and \
+           versions == set([protocol_version]) and \
+           len(self.clients) <= max_batch_servers:
+            self.sock = sockets.pop()
+            self.batch = ctypes.create_string_buffer(batch_engine.ledp_batch_size())
+            batch_engine.ledp_batch_setup(self.batch)
+            for client in self.clients:
+                index = batch_engine.ledp_batch_add_server(self.batch,
+                    self.sock.family, client.hostname, str(client.port))
+                if index < 0:
+                    raise Exception("couldn't resolve %s" % client.hostname)
 
     def set_led(self, id, value):
         client, led = self.leds[id]
         client.set_led(led, value)
 
+    def set_level(self, id, level):
+        client, led = self.leds[id]
+        client.set_level(led, level)
+
+    def set_decay(self, id, level, rate, tolerance=decay_tolerance):
+        client, led = self.leds[id]
+        client.set_decay(led, level, rate, tolerance)
+
     def release_led(self, id):
         client, led = self.leds[id]
         client.release_led(led)
@@ -98,10 +462,94 @@ class MultiClient:
         for client in self.clients:
             client.reset()
 
-    def commit(self):
-        for client in self.clients:
-            client.commit()
+    def commit(self, force=False):
+        if self.batch is None:
+            for client in self.clients:
+                client.commit(force)
+            return
 
+        # Collect due messages, and send them in one go
+        indices, masks, values = [], [], []
+        for index, client in enumerate(self.clients):
+            state = client.prepare_commit(force)
+            if state is None: continue
+            if state[0] >> 32 or state[2] or state[3]:
+                client.send_state(*state)
+                continue
+            indices.append(index)
+            masks.append(state[0])
+            values.append(state[1])
+        if not indices: return
+
+        count = len(indices)
+        sent = batch_engine.ledp_batch_send_buffer(self.batch, self.sock.fileno(), count,
+            (ctypes.c_uint32 * count)(*indices),
+            (ctypes.c_uint32 * count)(*masks),
+            (ctypes.c_uint32 * count)(*values))
+        if sent < count:
+            # The servers whose message wasn't sent get it on the next commit
+            error = ctypes.get_errno()
+            for index in indices[max(sent, 0):]:
+                self.clients[index].cancel_commit()
+            if error not in (errno.EAGAIN, errno.EWOULDBLOCK):
+                raise socket.error(error, os.strerror(error))
+
+    def get_stats(self):
+        """
+        Return the packets sent and suppressed,
+        summed over all the clients.
+        """
+        sent = sum(client.packets_sent for client in self.clients)
+        suppressed = sum(client.packets_suppressed for client in self.clients)
+        return sent, suppressed
+
+
+def get_word_range(mask):
+    """
+    Return the first and last 32-LED words having bits in `mask`,
+    as used in version 3 and 4 messages.
+    """
+    words = [word for word in xrange(max_leds // 32) if (mask >> (32 * word)) & 0xFFFFFFFF]
+    return (words[0], words[-1]) if words else (0, 0)
+
+def get_decayed_level(peak, now):
+    """
+    Return the level a decaying LED should be at by `now`, according to
+    its last `peak` (a (level, rate, time) tuple, see `Client.set_decay`).
+    """
+    level, rate, time = peak
+    return max(0, level - rate * (now - time))
+
+def parse_echo_reply(reply):
+    """
+    Decode the answer to a message sent with an echo token. Returns the
+    (token, received, written) tuple, where the times are in nanoseconds
+    of the server's monotonic clock. Returns None if the reply is invalid.
+    """
+    if len(reply) != echo_reply_size:
+        return None
+    return struct.unpack("!QQQ", reply)
+
+
+def declare_batch_engine(library):
+    """
+    Declare the functions of the native engine used by this module.
+    """
+    c_uint32_p = ctypes.POINTER(ctypes.c_uint32)
+    library.ledp_batch_size.restype = ctypes.c_size_t
+    library.ledp_batch_size.argtypes = []
+    library.ledp_batch_setup.restype = None
+    library.ledp_batch_setup.argtypes = [ctypes.c_void_p]
+    library.ledp_batch_add_server.restype = ctypes.c_int
+    library.ledp_batch_add_server.argtypes = [ctypes.c_void_p, ctypes.c_int,
+        ctypes.c_char_p, ctypes.c_char_p]
+    library.ledp_batch_send_buffer.restype = ctypes.c_int
+    library.ledp_batch_send_buffer.argtypes = [ctypes.c_void_p, ctypes.c_int,
+        ctypes.c_size_t, c_uint32_p, c_uint32_p, c_uint32_p]
+
+batch_engine = native.library
+if batch_engine is not None:
+    declare_batch_engine(batch_engine)
 
 
 if __name__ == "__main__":
@@ -111,37 +559,63 @@ Simple LEDP client, sends a LEDP message to the specified host.
 `<bits>` is a string of characters, which can be `0` (in which case, the
 LED is turned off), `1` (the LED is turned on) or anything else (the LED
 is not touched). The first character is the LED 0, the next is the
-LED 1, and the string needn't have all 32 characters present. Examples:
+LED 1, and the string needn't have all 32 characters present (it
+can have more, for servers with more LEDs). Examples:
 
 Turn off LEDs 2 and 6, turn on LED 3:
   ledp.py 192.168.1.6 __01__0
 
+Print the server's counters:
+  ledp.py --stats 192.168.1.6
+
+Print the ids and names of the server's LEDs:
+  ledp.py --names 192.168.1.6
+
 Usage:
   ledp.py [options] <hostname:port> <bits>
+  ledp.py --stats <hostname:port>
+  ledp.py --names <hostname:port>
   ledp.py (-h | --help)
 
 Options:
   -r <n>, --redundancy <n>  How many times to send the message. [default: 1]
+  -p <v>, --protocol <v>    LEDP version to use (1 or 2). [default: 1]
     """
 
-    import socket
-
     from docopt import docopt
     arguments = docopt(__doc__.strip())
 
     # Create client
-    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
     host = arguments["<hostname:port>"].split(":")
     if len(host) > 2:
         raise Exception("invalid host given")
-    if len(host) == 2:
-        client = Client(sock, host[0], int(host[1]))
-    else:
-        client = Client(sock, host[0])
+    port = int(host[1]) if len(host) == 2 else default_port
+    version = int(arguments["--protocol"] or protocol_version)
+    client = Client(None, host[0], port, version=version)
+
+    # Print counters, if asked
+    if arguments["--stats"]:
+        stats = client.request_stats()
+        if stats is None:
+            raise Exception("no answer from the server")
+        for name in sorted(stats):
+            print "%s: %s" % (name, stats[name])
+        client.close()
+        raise SystemExit
+
+    # Print LED names, if asked
+    if arguments["--names"]:
+        names = client.request_names()
+        if names is None:
+            raise Exception("no answer from the server")
+        for id in sorted(names):
+            print "%d: %s" % (id, names[id])
+        client.close()
+        raise SystemExit
 
     # Set LEDs
     bits = arguments["<bits>"]
-    if len(bits) > 32:
+    if len(bits) > max_leds:
         raise Exception("Invalid bits pattern given")
 
     for pos, value in enumerate(bits):
@@ -153,7 +627,7 @@ Options:
     # Send messages
     redundancy = int(arguments["--redundancy"])
     for i in xrange(redundancy):
-        client.commit()
+        client.commit(force=True)
 
     # Close
-    sock.close()
+    client.close()
@@ -0,0 +1,32 @@
+"""
+This module loads the native engine (`engine/libengine.so`), which is
+shared by the `filters` and `ledp` modules. Each of them declares the
+functions it uses. `library` is None if the engine hasn't been compiled.
+"""
+
+import os
+import ctypes
+
+
+def load_library(name="libengine.so"):
+    """
+    Load a library from `engine/`, returns None if it can't be found.
+    """
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "engine", name)
+    try:
+        return ctypes.CDLL(path, use_errno=True)
+    except OSError:
+        return None
+
+library = load_library()
+
+def buffer_pointer(buffer, ctype):
+    """
+    Return a ctypes pointer to the memory of `buffer`, which has to be a
+    contiguous numpy array (or other writable buffer) of items of `ctype`.
+    No data is copied.
+    """
+    if hasattr(buffer, "ctypes"):
+        assert buffer.itemsize == ctypes.sizeof(ctype) and buffer.flags.c_contiguous
+        return buffer.ctypes.data_as(ctypes.POINTER(ctype))
+    return (ctype * len(buffer)).from_buffer(buffer)
@@ -0,0 +1,95 @@
+"""
+This module binds the real-time engine (`engine/librealtime.so`). In this
+mode, the metering runs in native code inside the JACK process callback,
+and the levels are handed over a lock-free ring to the caller's thread,
+which maps them and does the LEDP sends. Thus, garbage collection pauses
+or network stalls in Python can't cause xruns.
+"""
+
+import ctypes
+import native
+from native import buffer_pointer
+
+# Maximum frames to read at once, see `RealtimeMeter.read()`
+max_read_frames = 256 # RING_FRAMES in engine/ring.h
+
+
+def declare_realtime(library):
+    """
+    Declare the functions of the real-time engine.
+    """
+    library.realtime_open.restype = ctypes.c_void_p
+    library.realtime_open.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+    library.realtime_sample_rate.restype = ctypes.c_uint
+    library.realtime_sample_rate.argtypes = [ctypes.c_void_p]
+    library.realtime_buffer_size.restype = ctypes.c_uint
+    library.realtime_buffer_size.argtypes = [ctypes.c_void_p]
+    library.realtime_start.restype = ctypes.c_int
+    library.realtime_start.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+        ctypes.POINTER(ctypes.c_uint)]
+    library.realtime_read.restype = ctypes.c_size_t
+    library.realtime_read.argtypes = [ctypes.c_void_p,
+        ctypes.POINTER(ctypes.c_double), ctypes.c_size_t, ctypes.c_uint]
+    library.realtime_overruns.restype = ctypes.c_size_t
+    library.realtime_overruns.argtypes = [ctypes.c_void_p]
+    library.realtime_close.restype = None
+    library.realtime_close.argtypes = [ctypes.c_void_p]
+
+library = native.load_library("librealtime.so")
+if library is not None:
+    declare_realtime(library)
+
+class RealtimeMeter:
+    """
+    JACK client with one or more input ports, that runs a
+    `NativeVolumeFollowBank` in the JACK real-time thread.
+    """
+
+    def __init__(self, name, inputs=1):
+        """
+        Open the JACK client, with name `name` and `inputs` input ports.
+        """
+        if library is None:
+            raise Exception("real-time engine not available, compile engine/librealtime.so")
+        self.meter = library.realtime_open(name, inputs)
+        if not self.meter:
+            raise Exception("couldn't open JACK client")
+        self.sample_rate = library.realtime_sample_rate(self.meter)
+        self.buffer_size = library.realtime_buffer_size(self.meter)
+
+    def start(self, bank, interval, sources=None):
+        """
+        Start processing audio with `bank` (whose state is copied, and
+        which shouldn't be used after this), generating a frame of levels
+        every `interval` samples. `sources` is the input port (from zero)
+        that every filter of the bank reads, all read the first by default.
+        """
+        if sources is not None:
+            sources = (ctypes.c_uint * bank.count)(*sources)
+        if library.realtime_start(self.meter, bank.state, interval, sources):
+            raise Exception("couldn't start real-time processing")
+        self.count = bank.count
+
+    def read(self, levels, timeout=0.1):
+        """
+        Wait (at most `timeout` seconds) for frames of levels, and
+        store them into `levels`, a 2D array of doubles (frames x filters).
+        Returns the number of frames stored.
+        """
+        assert levels.shape[1] == self.count
+        return library.realtime_read(self.meter,
+            buffer_pointer(levels, ctypes.c_double), len(levels), int(timeout * 1000))
+
+    def get_overruns(self):
+        """
+        Return how many frames have been dropped because the ring was full
+        (i.e. the reader didn't keep up).
+        """
+        return library.realtime_overruns(self.meter)
+
+    def close(self):
+        """
+        Stop processing and close the JACK client.
+        """
+        library.realtime_close(self.meter)
+        self.meter = None
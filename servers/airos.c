@@ -16,21 +16,53 @@
 
 #include "server.h"
 
+typedef struct gpio_command {
+  char line [8];
+  size_t length;
+} gpio_command;
+
 typedef struct server_data {
   int control_fd;
+
+  // Precomputed command for every pin and value
+  gpio_command commands [32][2];
+
+  // Last applied state, and which pins have been written at least once
+  uint32_t state;
+  uint32_t known;
 } server_data;
 
+void build_commands(server_data *data) {
+  unsigned i;
+  int value;
+  for (i = 0; i < 32; i++)
+    for (value = 0; value < 2; value++) {
+      gpio_command *command = &data->commands[i][value];
+      command->length = sprintf(command->line, "%u %d %d\n", i, value, value);
+    }
+}
+
 void handle_message(void *opaque, const ledp_packet* packet) {
   server_data *data = opaque;
 
+  // Only send commands for pins whose value flipped (or is unknown),
+  // there are only 32 so the first word has them all
+  uint32_t values = packet->values[0];
+  uint32_t changed = packet->mask[0] & ((data->state ^ values) | ~data->known);
+  if (!changed) return;
+  data->state = (data->state & ~changed) | (values & changed);
+  data->known |= changed;
+  count_ledp_writes(0, changed);
+
   // Prepare commands
   char commands [7*32];
   size_t commands_length = 0;
-  size_t i;
-  for (i = 0; i < 32; i++) {
-    if (!(packet->mask & (1 << i))) continue;
-    int value = !!(packet->values & (1 << i));
-    commands_length += sprintf(commands + commands_length, "%u %d %d\n", i, value, value);
+  while (changed) {
+    size_t i = __builtin_ctz(changed);
+    changed &= changed - 1;
+    const gpio_command *command = &data->commands[i][!!(values & (1u << i))];
+    memcpy(commands + commands_length, command->line, command->length);
+    commands_length += command->length;
   }
 
   // Directly using UNIX I/O is better here
@@ -41,6 +73,8 @@ void handle_message(void *opaque, const ledp_packet* packet) {
 int main(int argc, char **argv) {
   // Open AirOS-specific LED control file
   server_data data;
+  build_commands(&data);
+  data.state = data.known = 0;
   data.control_fd = open("/proc/gpio/system_led", O_WRONLY);
   assert(data.control_fd != -1);
 
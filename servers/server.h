@@ -2,8 +2,54 @@
  * Implemenents a simple LEDP server that calls a user-supplied
  * function whenever a valid LEDP message arrives.
  * This is the common logic used by the actual servers.
+ *
+ * All queued messages are received at once (with `recvmmsg` where
+ * available) and merged in order, so the handler runs once per batch
+ * with the latest state instead of once per message.
+ *
+ * Version 2 messages carry a sequence number and a timestamp, and one or
+ * more consecutive frames (the latest LED states sent). For every sender,
+ * frames that aren't newer than the last one applied are dropped, and so
+ * are whole messages that took much longer to arrive than usual. Clients
+ * can repeat the last frames in every message, so that a lost message is
+ * recovered by the next one. Version 1 messages are still accepted.
+ *
+ * Version 3 messages carry a bitmap of up to MAX_LEDS LEDs, as a range of
+ * 32-LED words, so that a single message can update a whole fixture. The
+ * handler receives a packet with all the words of the merged messages.
+ *
+ * Version 4 messages set brightness levels (0 to 255) instead of on/off.
+ * Backends that can't dim LEDs just use the `values` bits, which are set
+ * for levels from 128 on.
+ *
+ * Version 5 messages make the server animate the LEDs itself: every LED
+ * gets a level and a release rate, and goes down from there on its own,
+ * stepped by a local timer every DECAY_STEP_MS. Levels go above 255 (the
+ * LED shows at most 255), so that a bar meter falls LED by LED when all
+ * LEDs of it have the same rate. A LED only takes a level higher than the
+ * one it's decaying from, so clients just send the peaks, and repeating
+ * an old message doesn't bring a LED back up. Other messages stop the
+ * decay of the LEDs they set.
+ *
+ * A message can carry an 8-byte token after the usual contents. The server
+ * then answers it, after the handler returns, with the token and the times
+ * (in nanoseconds, monotonic clock) when the message was received and when
+ * the handler finished. `ledp-load.py` uses this to measure latency.
+ *
+ * The server also keeps counters of the messages received and rejected,
+ * a histogram of the handler times and the writes to every LED (which the
+ * backends report with `count_ledp_writes`). They are dumped to stderr on
+ * SIGUSR1, and sent back as text to a single-byte STATS_REQUEST message.
+ *
+ * Backends can name their LEDs with `set_ledp_led_names`, and the server
+ * then answers a single-byte NAMES_REQUEST message with a line for every
+ * LED, its index and its name, so clients can find the LEDs to use.
  **/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,19 +57,158 @@
 #include <string.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #define DEFAULT_PORT 5021
 #define DEFAULT_PORT_STRING "5021"
 #define PROTOCOL_VERSION 1
+#define SEQUENCED_PROTOCOL_VERSION 2
+#define BITMAP_PROTOCOL_VERSION 3
+#define LEVELS_PROTOCOL_VERSION 4
+#define DECAY_PROTOCOL_VERSION 5
+#define PACKET_SIZE 9
+#define ECHO_TOKEN_SIZE 8
+#define ECHO_PACKET_SIZE (PACKET_SIZE + ECHO_TOKEN_SIZE)
+#define ECHO_REPLY_SIZE 24
+#define SEQUENCED_HEADER_SIZE 10
+#define FRAME_SIZE 8
+#define MAX_FRAMES 8
+#define BITMAP_HEADER_SIZE 3
+#define LEVELS_HEADER_SIZE 3
+#define DECAY_HEADER_SIZE 3
+#define DECAY_LED_SIZE 4
+#define DECAY_STEP_MS 20
+#define MAX_LEDS 512
+#define LED_WORDS (MAX_LEDS / 32)
+
+// The largest message is a version 5 one with all LEDs
+#define MAX_PACKET_SIZE (DECAY_HEADER_SIZE + LED_WORDS * 4 + MAX_LEDS * DECAY_LED_SIZE + ECHO_TOKEN_SIZE)
+#define RECEIVE_BATCH 32
+#define STATS_REQUEST 'S'
+#define STATS_SIZE 8192
+#define NAMES_REQUEST 'N'
+#define NAMES_SIZE 16384
+#define HISTOGRAM_BUCKETS 16
+#define MAX_SENDERS 16
+#define SENDER_TIMEOUT_MS 2000
+#define MAX_FRAME_DELAY_MS 250
+
+#define PARSE_INVALID_SIZE 1
+#define PARSE_INVALID_VERSION 2
 
+/**
+ * LED states to apply. Word i of `mask` and `values` has the LEDs 32*i
+ * to 32*i+31, and words from `words` on are zero.
+ *
+ * LEDs with their bit set in `level_mask` have a brightness level instead,
+ * in `levels` (their `values` bit is set if it's 128 or more).
+ **/
 typedef struct ledp_packet {
   uint8_t protocol_version;
-  uint32_t mask;
-  uint32_t values;
+  int words;
+  uint32_t mask [LED_WORDS];
+  uint32_t values [LED_WORDS];
+  uint32_t level_mask [LED_WORDS];
+  uint8_t levels [MAX_LEDS];
 } ledp_packet;
 
+typedef struct ledp_message {
+  char data [MAX_PACKET_SIZE];
+  int length;
+  struct sockaddr_storage address;
+  socklen_t address_length;
+  int echo;
+} ledp_message;
+
+/**
+ * State kept for every sender of version 2 messages.
+ **/
+typedef struct ledp_sender {
+  struct sockaddr_storage address;
+  socklen_t address_length;
+  uint32_t last_heard;
+
+  // Last frame applied, and the usual difference between our
+  // clock and the sender's (both in milliseconds)
+  uint32_t sequence;
+  int32_t offset;
+} ledp_sender;
+
+/**
+ * LEDs decaying on their own (see version 5 at the top of this file).
+ * Levels are in 1/256 units (so that slow rates still move at every
+ * step), rates are in levels per second.
+ **/
+typedef struct ledp_decay {
+  uint32_t active [LED_WORDS];
+  uint32_t levels [MAX_LEDS];
+  uint16_t rates [MAX_LEDS];
+  uint8_t shown [MAX_LEDS];
+  uint64_t last_step;
+} ledp_decay;
+
+typedef struct ledp_stats {
+  unsigned long received;
+  unsigned long batches;
+  unsigned long rejected_size;
+  unsigned long rejected_version;
+  unsigned long rejected_late;
+  unsigned long frames_old;
+  unsigned long frames_lost;
+  unsigned long decay_steps;
+
+  // Bucket i counts handler calls taking less than 2^i microseconds
+  // (the last one counts the rest)
+  unsigned long handler_times [HISTOGRAM_BUCKETS];
+
+  unsigned long led_writes [MAX_LEDS];
+} ledp_stats;
+
+static ledp_stats __stats;
+static volatile sig_atomic_t __stats_requested = 0;
+static ledp_sender __senders [MAX_SENDERS];
+static int __senders_count = 0;
+static ledp_decay __decay;
+static const char *const *__led_names = NULL;
+static int __led_names_count = 0;
+
+/**
+ * Called by the backends to set the names of their LEDs (`names[i]` being
+ * the LED with index i), answered to NAMES_REQUEST messages. The names
+ * have to stay valid while the server runs.
+ **/
+static inline void set_ledp_led_names(const char *const *names, int count) {
+  __led_names = names;
+  __led_names_count = count;
+}
+
+/**
+ * Called by the backends to count the LEDs they actually wrote
+ * (`leds` being a word of the bitmap, as in `ledp_packet`).
+ **/
+static inline void count_ledp_writes(int word, uint32_t leds) {
+  while (leds) {
+    __stats.led_writes[32 * word + __builtin_ctz(leds)]++;
+    leds &= leds - 1;
+  }
+}
+
+static uint64_t __monotonic_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void __write_uint64(char *output, uint64_t value) {
+  int i;
+  for (i = 7; i >= 0; i--, value >>= 8)
+    output[i] = value & 0xFF;
+}
+
 static int __initialize_socket(const char *port) {
   int status;
   struct addrinfo hints, *addresses, *a;
@@ -58,24 +243,511 @@ static int __initialize_socket(const char *port) {
   return sock;
 }
 
+/**
+ * Block until at least one message arrives, then receive as many queued
+ * messages as possible into `messages`, together with their senders.
+ * Returns the number of messages received, or -1 on error.
+ **/
+static int __receive_batch(int sock, ledp_message *messages) {
+#ifdef MSG_WAITFORONE
+  struct mmsghdr headers [RECEIVE_BATCH];
+  struct iovec iovecs [RECEIVE_BATCH];
+  int i, count;
+  memset(headers, 0x00, sizeof(headers));
+  for (i = 0; i < RECEIVE_BATCH; i++) {
+    iovecs[i].iov_base = messages[i].data;
+    iovecs[i].iov_len = MAX_PACKET_SIZE;
+    headers[i].msg_hdr.msg_iov = &iovecs[i];
+    headers[i].msg_hdr.msg_iovlen = 1;
+    headers[i].msg_hdr.msg_name = &messages[i].address;
+    headers[i].msg_hdr.msg_namelen = sizeof(messages[i].address);
+  }
+  count = recvmmsg(sock, headers, RECEIVE_BATCH, MSG_WAITFORONE, NULL);
+  for (i = 0; i < count; i++) {
+    messages[i].length = headers[i].msg_len;
+    messages[i].address_length = headers[i].msg_hdr.msg_namelen;
+  }
+  return count;
+#else
+  // No recvmmsg (i.e. old uClibc), receive one at a time
+  messages[0].address_length = sizeof(messages[0].address);
+  messages[0].length = recvfrom(sock, messages[0].data, MAX_PACKET_SIZE, 0,
+    (struct sockaddr *) &messages[0].address, &messages[0].address_length);
+  return (messages[0].length < 0) ? -1 : 1;
+#endif
+}
+
+/**
+ * Answer an echo message, see the top of this file.
+ **/
+static void __send_echo_reply(int sock, const ledp_message *message, uint64_t received, uint64_t written) {
+  char reply [ECHO_REPLY_SIZE];
+  memcpy(reply, message->data + message->length - ECHO_TOKEN_SIZE, ECHO_TOKEN_SIZE);
+  __write_uint64(reply + 8, received);
+  __write_uint64(reply + 16, written);
+  sendto(sock, reply, ECHO_REPLY_SIZE, MSG_DONTWAIT,
+    (const struct sockaddr *) &message->address, message->address_length);
+}
+
+static void __count_handler_time(uint64_t nanoseconds) {
+  uint64_t limit = 1000;
+  int bucket = 0;
+  while (bucket < HISTOGRAM_BUCKETS - 1 && nanoseconds >= limit) {
+    limit <<= 1;
+    bucket++;
+  }
+  __stats.handler_times[bucket]++;
+}
+
+/**
+ * Format the counters as text into `output`, returning its length.
+ **/
+static int __format_stats(char *output) {
+  int i, length = 0;
+  length += snprintf(output + length, STATS_SIZE - length,
+    "received %lu\nbatches %lu\nrejected-size %lu\nrejected-version %lu\nrejected-late %lu\n"
+    "frames-old %lu\nframes-lost %lu\ndecay-steps %lu\nhandler-us",
+    __stats.received, __stats.batches, __stats.rejected_size, __stats.rejected_version,
+    __stats.rejected_late, __stats.frames_old, __stats.frames_lost, __stats.decay_steps);
+  for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+    if (__stats.handler_times[i])
+      length += snprintf(output + length, STATS_SIZE - length, " <%lu:%lu", 1ul << i, __stats.handler_times[i]);
+  if (__stats.handler_times[i])
+    length += snprintf(output + length, STATS_SIZE - length, " more:%lu", __stats.handler_times[i]);
+  length += snprintf(output + length, STATS_SIZE - length, "\nled-writes");
+  for (i = 0; i < MAX_LEDS && length < STATS_SIZE - 32; i++)
+    if (__stats.led_writes[i])
+      length += snprintf(output + length, STATS_SIZE - length, " %d:%lu", i, __stats.led_writes[i]);
+  length += snprintf(output + length, STATS_SIZE - length, "\n");
+  return length;
+}
+
+static void __send_stats_reply(int sock, const ledp_message *message) {
+  char reply [STATS_SIZE];
+  int length = __format_stats(reply);
+  sendto(sock, reply, length, MSG_DONTWAIT,
+    (const struct sockaddr *) &message->address, message->address_length);
+}
+
+/**
+ * Answer a NAMES_REQUEST message, with as many names as fit.
+ **/
+static void __send_names_reply(int sock, const ledp_message *message) {
+  char reply [NAMES_SIZE];
+  int i, length = 0;
+  for (i = 0; i < __led_names_count; i++) {
+    int line_length = snprintf(reply + length, NAMES_SIZE - length, "%d %s\n", i, __led_names[i]);
+    if (line_length >= NAMES_SIZE - length) break;
+    length += line_length;
+  }
+  sendto(sock, reply, length, MSG_DONTWAIT,
+    (const struct sockaddr *) &message->address, message->address_length);
+}
+
+static void __request_stats(int signal) {
+  (void) signal;
+  __stats_requested = 1;
+}
+
+/**
+ * Validate and parse a received message. Returns non-zero
+ * (PARSE_INVALID_SIZE or PARSE_INVALID_VERSION) if invalid.
+ **/
+static int __parse_packet(const char *received, int length, ledp_packet *packet) {
+  if (length != PACKET_SIZE && length != ECHO_PACKET_SIZE)
+    return PARSE_INVALID_SIZE;
+
+  packet->protocol_version = *(uint8_t*)(received+0);
+  if (packet->protocol_version != PROTOCOL_VERSION)
+    return PARSE_INVALID_VERSION;
+  packet->words = 1;
+  packet->mask[0] = htonl(*(uint32_t*)(received+1));
+  packet->values[0] = htonl(*(uint32_t*)(received+5));
+  return 0;
+}
+
+static void __merge_frame(ledp_packet *merged, int word, uint32_t mask, uint32_t values) {
+  merged->values[word] = (merged->values[word] & ~mask) | (values & mask);
+  merged->mask[word] |= mask;
+  merged->level_mask[word] &= ~mask;
+  if (mask && word >= merged->words)
+    merged->words = word + 1;
+  __decay.active[word] &= ~mask;
+}
+
+/**
+ * Merge a LED at a brightness level (0 to 255) into `merged`.
+ **/
+static void __merge_level(ledp_packet *merged, int index, uint8_t level) {
+  int word = index / 32;
+  uint32_t bit = 1u << (index % 32);
+  __merge_frame(merged, word, bit, (level >= 128) ? bit : 0);
+  merged->levels[index] = level;
+  if (level != 0 && level != 255)
+    merged->level_mask[word] |= bit;
+}
+
+static int __decay_is_active() {
+  int word;
+  for (word = 0; word < LED_WORDS; word++)
+    if (__decay.active[word]) return 1;
+  return 0;
+}
+
+/**
+ * Validate a version 5 message, starting the decay of its LEDs (and
+ * merging their current level into `merged`). `now` is the current
+ * time in nanoseconds. Returns non-zero if invalid.
+ **/
+static int __merge_decay(ledp_message *message, ledp_packet *merged, uint64_t now) {
+  const char *received = message->data;
+  if (message->length < DECAY_HEADER_SIZE)
+    return PARSE_INVALID_SIZE;
+  int first = *(uint8_t*)(received+1);
+  int words = *(uint8_t*)(received+2);
+  if (words < 1 || first + words > LED_WORDS ||
+      message->length < DECAY_HEADER_SIZE + words * 4)
+    return PARSE_INVALID_SIZE;
+
+  // After the masks comes a level and a rate for each LED in them
+  int i, size = DECAY_HEADER_SIZE + words * 4;
+  uint32_t masks [LED_WORDS];
+  for (i = 0; i < words; i++) {
+    masks[i] = htonl(*(uint32_t*)(received + DECAY_HEADER_SIZE + i * 4));
+    size += __builtin_popcount(masks[i]) * DECAY_LED_SIZE;
+  }
+  if (message->length != size && message->length != size + ECHO_TOKEN_SIZE)
+    return PARSE_INVALID_SIZE;
+  message->echo = (message->length != size);
+
+  // Steps start counting from the first decaying LED
+  if (!__decay_is_active())
+    __decay.last_step = now;
+
+  const char *led_data = received + DECAY_HEADER_SIZE + words * 4;
+  for (i = 0; i < words; i++) {
+    int word = first + i;
+    uint32_t leds = masks[i];
+    while (leds) {
+      int index = 32 * word + __builtin_ctz(leds);
+      uint32_t bit = leds & -leds;
+      leds &= leds - 1;
+      uint32_t level = (uint32_t)htons(*(uint16_t*)(led_data+0)) << 8;
+      uint16_t rate = htons(*(uint16_t*)(led_data+2));
+      led_data += DECAY_LED_SIZE;
+
+      // A rate of zero just sets the level
+      int active = (__decay.active[word] & bit) != 0;
+      if (rate && active && __decay.levels[index] > level)
+        level = __decay.levels[index];
+      uint8_t shown = (level >> 8 > 255) ? 255 : level >> 8;
+      __merge_level(merged, index, shown);
+      if (rate && level) {
+        __decay.active[word] |= bit;
+        __decay.levels[index] = level;
+        __decay.rates[index] = rate;
+        __decay.shown[index] = shown;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Milliseconds until the next decay step is due (0 if it's
+ * already due), or -1 if no LEDs are decaying.
+ **/
+static int __decay_timeout(uint64_t now) {
+  if (!__decay_is_active())
+    return -1;
+  uint64_t elapsed = (now - __decay.last_step) / 1000000;
+  return (elapsed >= DECAY_STEP_MS) ? 0 : DECAY_STEP_MS - elapsed;
+}
+
+/**
+ * Take the decaying LEDs down by the time elapsed since the last step,
+ * merging the ones whose shown level changes into `packet`.
+ **/
+static void __step_decay(ledp_packet *packet, uint64_t now) {
+  uint64_t elapsed = now - __decay.last_step;
+  int word;
+  __decay.last_step = now;
+  __stats.decay_steps++;
+
+  for (word = 0; word < LED_WORDS; word++) {
+    uint32_t leds = __decay.active[word];
+    while (leds) {
+      int index = 32 * word + __builtin_ctz(leds);
+      uint32_t bit = leds & -leds;
+      leds &= leds - 1;
+
+      uint64_t drop = (uint64_t)__decay.rates[index] * elapsed * 256 / 1000000000;
+      uint32_t level = (__decay.levels[index] > drop) ? __decay.levels[index] - drop : 0;
+      uint8_t shown = (level >> 8 > 255) ? 255 : level >> 8;
+      __decay.levels[index] = level;
+      if (shown != __decay.shown[index]) {
+        __merge_level(packet, index, shown);
+        __decay.shown[index] = shown;
+      }
+      if (level)
+        __decay.active[word] |= bit;
+      else
+        __decay.active[word] &= ~bit;
+    }
+  }
+}
+
+/**
+ * Validate a version 4 message, and merge its levels into `merged`.
+ * Returns non-zero if invalid.
+ **/
+static int __merge_levels(ledp_message *message, ledp_packet *merged) {
+  const char *received = message->data;
+  if (message->length < LEVELS_HEADER_SIZE)
+    return PARSE_INVALID_SIZE;
+  int first = *(uint8_t*)(received+1);
+  int words = *(uint8_t*)(received+2);
+  if (words < 1 || first + words > LED_WORDS ||
+      message->length < LEVELS_HEADER_SIZE + words * 4)
+    return PARSE_INVALID_SIZE;
+
+  // After the masks comes a level for each LED in them
+  int i, size = LEVELS_HEADER_SIZE + words * 4;
+  uint32_t masks [LED_WORDS];
+  for (i = 0; i < words; i++) {
+    masks[i] = htonl(*(uint32_t*)(received + LEVELS_HEADER_SIZE + i * 4));
+    size += __builtin_popcount(masks[i]);
+  }
+  if (message->length != size && message->length != size + ECHO_TOKEN_SIZE)
+    return PARSE_INVALID_SIZE;
+  message->echo = (message->length != size);
+
+  const uint8_t *level = (const uint8_t *)received + LEVELS_HEADER_SIZE + words * 4;
+  for (i = 0; i < words; i++) {
+    int word = first + i;
+    uint32_t mask = masks[i], values = 0, partial = 0, leds = masks[i];
+    while (leds) {
+      int led = __builtin_ctz(leds);
+      leds &= leds - 1;
+      merged->levels[32 * word + led] = *level;
+      if (*level >= 128) values |= 1u << led;
+      if (*level != 0 && *level != 255) partial |= 1u << led;
+      level++;
+    }
+    __merge_frame(merged, word, mask, values);
+    merged->level_mask[word] |= partial;
+  }
+  return 0;
+}
+
+/**
+ * Validate a version 3 message, and merge its words into `merged`.
+ * Returns non-zero if invalid.
+ **/
+static int __merge_bitmap(ledp_message *message, ledp_packet *merged) {
+  const char *received = message->data;
+  if (message->length < BITMAP_HEADER_SIZE)
+    return PARSE_INVALID_SIZE;
+  int first = *(uint8_t*)(received+1);
+  int words = *(uint8_t*)(received+2);
+  int size = BITMAP_HEADER_SIZE + words * FRAME_SIZE;
+  if (words < 1 || first + words > LED_WORDS ||
+      (message->length != size && message->length != size + ECHO_TOKEN_SIZE))
+    return PARSE_INVALID_SIZE;
+  message->echo = (message->length != size);
+
+  int i;
+  for (i = 0; i < words; i++) {
+    const char *word = received + BITMAP_HEADER_SIZE + i * FRAME_SIZE;
+    __merge_frame(merged, first + i, htonl(*(uint32_t*)(word+0)), htonl(*(uint32_t*)(word+4)));
+  }
+  return 0;
+}
+
+/**
+ * Find the state of the sender of a message. Senders not heard from in
+ * SENDER_TIMEOUT_MS (i.e. restarted clients) start again from scratch,
+ * replacing the least recently heard one if the table is full.
+ **/
+static ledp_sender *__find_sender(const ledp_message *message, uint32_t now, int *is_new) {
+  ledp_sender *sender = NULL, *oldest = &__senders[0];
+  int i;
+  for (i = 0; i < __senders_count; i++) {
+    ledp_sender *s = &__senders[i];
+    if (s->address_length == message->address_length &&
+        !memcmp(&s->address, &message->address, message->address_length)) {
+      sender = s;
+      break;
+    }
+    if ((int32_t)(s->last_heard - oldest->last_heard) < 0)
+      oldest = s;
+  }
+
+  *is_new = !sender || (int32_t)(now - sender->last_heard) > SENDER_TIMEOUT_MS;
+  if (!sender) {
+    sender = (__senders_count < MAX_SENDERS) ? &__senders[__senders_count++] : oldest;
+    memcpy(&sender->address, &message->address, message->address_length);
+    sender->address_length = message->address_length;
+  }
+  sender->last_heard = now;
+  return sender;
+}
+
+/**
+ * Validate a version 2 message, and merge its new frames into `merged`.
+ * `now` is the current time in milliseconds. Returns non-zero if invalid.
+ **/
+static int __merge_sequenced(ledp_message *message, ledp_packet *merged, uint32_t now) {
+  const char *received = message->data;
+  if (message->length < SEQUENCED_HEADER_SIZE)
+    return PARSE_INVALID_SIZE;
+  int frames = *(uint8_t*)(received+9);
+  int size = SEQUENCED_HEADER_SIZE + frames * FRAME_SIZE;
+  if (frames < 1 || frames > MAX_FRAMES ||
+      (message->length != size && message->length != size + ECHO_TOKEN_SIZE))
+    return PARSE_INVALID_SIZE;
+
+  uint32_t sequence = htonl(*(uint32_t*)(received+1));
+  uint32_t timestamp = htonl(*(uint32_t*)(received+5));
+  int is_new;
+  ledp_sender *sender = __find_sender(message, now, &is_new);
+
+  // Compare how long this took to arrive with the usual, adapting
+  // slowly to changes (and to clock drift)
+  int32_t delay = (int32_t)(now - timestamp);
+  if (is_new) sender->offset = delay;
+  delay -= sender->offset;
+  sender->offset += (delay < 0) ? delay : delay / 64;
+  if (delay > MAX_FRAME_DELAY_MS) {
+    __stats.rejected_late++;
+    return 0;
+  }
+
+  // Apply the frames newer than the last one (and only answer
+  // the echo if some was)
+  int i;
+  for (i = 0; i < frames; i++, sequence++) {
+    int32_t gap = (int32_t)(sequence - sender->sequence);
+    if (!is_new && gap <= 0) {
+      __stats.frames_old++;
+      continue;
+    }
+    if (!is_new) __stats.frames_lost += gap - 1;
+    is_new = 0;
+    message->echo = (message->length != size);
+    sender->sequence = sequence;
+    const char *frame = received + SEQUENCED_HEADER_SIZE + i * FRAME_SIZE;
+    __merge_frame(merged, 0, htonl(*(uint32_t*)(frame+0)), htonl(*(uint32_t*)(frame+4)));
+  }
+  return 0;
+}
+
 static int start_ledp_server(const char *port, void (*handler)(void *opaque, const ledp_packet *packet), void *opaque) {
   // Create and bind a socket
   int sock = __initialize_socket(port);
   if (sock == -1) return 1;
 
-  // Accept, validate and process messages
+  // Dump the counters on SIGUSR1 (without SA_RESTART, so that it
+  // interrupts the receive)
+  struct sigaction action;
+  memset(&action, 0x00, sizeof(action));
+  action.sa_handler = __request_stats;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+
+  // Messages are big enough with version 5, keep them off the stack
+  static ledp_message messages [RECEIVE_BATCH];
+
+  // Accept, validate and merge messages, then process the result
   while (1) {
-    char received [9];
-    ledp_packet packet;
-    if (recv(sock, &received, 9, 0) != 9)
+    // While LEDs decay, wait for messages only until the next step
+    int timeout = __decay_timeout(__monotonic_time());
+    if (timeout == 0) {
+      ledp_packet stepped;
+      memset(&stepped, 0x00, sizeof(stepped));
+      stepped.protocol_version = PROTOCOL_VERSION;
+      uint64_t handled = __monotonic_time();
+      __step_decay(&stepped, handled);
+      if (stepped.words) {
+        handler(opaque, &stepped);
+        __count_handler_time(__monotonic_time() - handled);
+      }
+      continue;
+    }
+    int count = 0;
+    if (timeout < 0) {
+      count = __receive_batch(sock, messages);
+    } else {
+      struct pollfd ready = { sock, POLLIN, 0 };
+      if (poll(&ready, 1, timeout) > 0)
+        count = __receive_batch(sock, messages);
+    }
+    if (__stats_requested) {
+      char stats [STATS_SIZE];
+      __stats_requested = 0;
+      fwrite(stats, 1, __format_stats(stats), stderr);
+    }
+    if (count <= 0)
+      continue;
+    uint64_t received = __monotonic_time();
+    uint32_t received_ms = received / 1000000;
+    __stats.received += count;
+    __stats.batches++;
+
+    ledp_packet merged, packet;
+    int i, valid = 0, echoes = 0;
+    memset(&merged, 0x00, sizeof(merged));
+    merged.protocol_version = PROTOCOL_VERSION;
+    for (i = 0; i < count; i++) {
+      messages[i].echo = 0;
+      if (messages[i].length == 1 && messages[i].data[0] == STATS_REQUEST) {
+        __send_stats_reply(sock, &messages[i]);
+        continue;
+      }
+      if (messages[i].length == 1 && messages[i].data[0] == NAMES_REQUEST) {
+        __send_names_reply(sock, &messages[i]);
+        continue;
+      }
+      int status;
+      int version = (messages[i].length > 0) ? messages[i].data[0] : 0;
+      if (version == SEQUENCED_PROTOCOL_VERSION) {
+        status = __merge_sequenced(&messages[i], &merged, received_ms);
+      } else if (version == BITMAP_PROTOCOL_VERSION) {
+        status = __merge_bitmap(&messages[i], &merged);
+      } else if (version == LEVELS_PROTOCOL_VERSION) {
+        status = __merge_levels(&messages[i], &merged);
+      } else if (version == DECAY_PROTOCOL_VERSION) {
+        status = __merge_decay(&messages[i], &merged, received);
+      } else {
+        status = __parse_packet(messages[i].data, messages[i].length, &packet);
+        if (!status) {
+          __merge_frame(&merged, 0, packet.mask[0], packet.values[0]);
+          messages[i].echo = (messages[i].length == ECHO_PACKET_SIZE);
+        }
+      }
+      if (status == PARSE_INVALID_SIZE) __stats.rejected_size++;
+      if (status == PARSE_INVALID_VERSION) __stats.rejected_version++;
+      if (status)
+        continue;
+      echoes += messages[i].echo;
+      valid++;
+    }
+    if (!valid)
       continue;
+    uint64_t written = received;
+    if (merged.words) {
+      uint64_t handled = __monotonic_time();
+      handler(opaque, &merged);
+      written = __monotonic_time();
+      __count_handler_time(written - handled);
+    }
 
-    packet.protocol_version = *(uint8_t*)(received+0);
-    if (packet.protocol_version != PROTOCOL_VERSION)
+    // Answer echo messages, now that their state has been written
+    if (!echoes)
       continue;
-    packet.mask = htonl(*(uint32_t*)(received+1));
-    packet.values = htonl(*(uint32_t*)(received+5));
-    handler(opaque, &packet);
+    for (i = 0; i < count; i++)
+      if (messages[i].echo)
+        __send_echo_reply(sock, &messages[i], received, written);
   }
 
   // Close the socket
@@ -1,63 +1,157 @@
 /**
  * Server that exports the LEDs available in `/sys/class/leds`.
  * Especially indicated for OpenWRT or modern linuxes.
+ *
+ * By default all LEDs are served, in alphabetical order. The LEDs to serve
+ * can also be given in the command line (in order), or read from a cache
+ * file, which is written after scanning if it doesn't exist yet, so that
+ * later starts don't scan the directory nor read the max brightness of
+ * every LED. The cache has a line per LED, with its name and its max
+ * brightness. Either way, clients can ask for the names (see server.h).
+ *
+ * With `-w <workers>`, the writes for a packet are done in a batch (see
+ * writer.h), for LEDs that are slow to write.
  **/
 
 #include "server.h"
+#include "writer.h"
 #include <dirent.h>
+#include <limits.h>
+
+#define MAX_NAME_LENGTH 255
 
 typedef struct led_entry {
+  char name [MAX_NAME_LENGTH + 1];
   int brightness_fd;
   int max_brightness;
+
+  // Preformatted line that turns the LED on, and
+  // the last line with a brightness level
+  char on_line [16];
+  size_t on_line_length;
+  char level_line [16];
 } led_entry;
 
 typedef struct server_data {
   led_entry *entries;
   size_t entries_count;
   size_t entries_found;
+  const char *names [MAX_LEDS];
+
+  // Last applied state, and which LEDs have been written at least once
+  uint32_t state [LED_WORDS];
+  uint32_t known [LED_WORDS];
+
+  // LEDs currently at a partial brightness, and their level
+  uint32_t partial [LED_WORDS];
+  uint8_t levels [MAX_LEDS];
+
+  led_writer writer;
 } server_data;
 
+static const char off_line [] = "0\n";
+
+/**
+ * Set a LED to a brightness level, scaled from 0-255 to its maximum.
+ **/
+static void write_level(server_data *data, led_entry *entry, int level) {
+  size_t line_length = sprintf(entry->level_line, "%d\n", (level * entry->max_brightness + 127) / 255);
+  led_writer_add(&data->writer, entry->brightness_fd, entry->level_line, line_length);
+}
+
 void handle_message(void *opaque, const ledp_packet *packet) {
   server_data *data = opaque;
+  int word;
 
-  size_t led;
-  for (led = 0; led < data->entries_count; led++) {
-    if (!(packet->mask & (1 << led))) continue;
+  for (word = 0; word < packet->words && 32 * (size_t)word < data->entries_count; word++) {
+    // Only write the LEDs whose state changed (or is unknown)
+    size_t left = data->entries_count - 32 * word;
+    uint32_t served = (left >= 32) ? ~0u : ((1u << left) - 1);
+    uint32_t values = packet->values[word];
+    uint32_t leveled = packet->mask[word] & served & packet->level_mask[word];
+    uint32_t changed = packet->mask[word] & served & ~leveled &
+      ((data->state[word] ^ values) | ~data->known[word] | data->partial[word]);
+
+    // LEDs at a brightness level are written if the level changed
+    while (leveled) {
+      size_t led = __builtin_ctz(leveled);
+      leveled &= leveled - 1;
+      uint32_t bit = 1u << led;
+      size_t index = 32 * word + led;
+      if ((data->partial[word] & data->known[word] & bit) && data->levels[index] == packet->levels[index])
+        continue;
+      write_level(data, &data->entries[index], packet->levels[index]);
+      data->levels[index] = packet->levels[index];
+      data->partial[word] |= bit;
+      data->known[word] |= bit;
+      count_ledp_writes(word, bit);
+    }
+
+    data->state[word] = (data->state[word] & ~changed) | (values & changed);
+    data->known[word] |= changed;
+    data->partial[word] &= ~changed;
+    count_ledp_writes(word, changed);
+
+    while (changed) {
+      size_t led = __builtin_ctz(changed);
+      changed &= changed - 1;
 
-    led_entry *entry = &data->entries[led];
-    int value = (packet->values & (1 << led)) ? entry->max_brightness : 0;
+      led_entry *entry = &data->entries[32 * word + led];
+      const char *line = off_line;
+      size_t line_length = sizeof(off_line) - 1;
+      if (values & (1u << led)) {
+        line = entry->on_line;
+        line_length = entry->on_line_length;
+      }
 
-    // Directly using UNIX I/O is better here
-    char line [16];
-    size_t line_length = sprintf(line, "%d\n", value);
-    size_t written = write(entry->brightness_fd, line, line_length);
-    assert(written == line_length);
+      // Every LED is written at most once per packet, so
+      // the writes of a batch can be done in any order
+      led_writer_add(&data->writer, entry->brightness_fd, line, line_length);
+    }
   }
+
+  // Wait for all the writes of the packet
+  led_writer_flush(&data->writer);
 }
 
-int process_led(server_data *data, const char *name) {
+/**
+ * Open a LED and append it to the entries. Its max brightness is read
+ * from sysfs, unless `max_brightness` is given (non-negative).
+ **/
+int process_led(server_data *data, const char *name, int max_brightness) {
   char path [288];
   int name_length = strlen(name);
+  if (name_length > MAX_NAME_LENGTH) {
+    fprintf(stderr, "LED name too long: %s\n", name);
+    return 1;
+  }
   memcpy(path, name, name_length);
 
   // Append entry if possible
   data->entries_found++;
-  if (data->entries_count >= 32)
-    return 1;
-  led_entry *entry = &data->entries[data->entries_count++];
+  if (data->entries_count >= MAX_LEDS)
+    return 0;
+  led_entry *entry = &data->entries[data->entries_count];
+  memcpy(entry->name, name, name_length + 1);
+  data->names[data->entries_count++] = entry->name;
 
   // Scan LED's max brightness
-  path[name_length] = 0;
-  strcat(path, "/max_brightness");
-  FILE *mbfile = fopen(path, "r");
-  if (!mbfile) {
-    fprintf(stderr, "Couldn't open %s for reading\n", path);
-    return 1;
-  }
-  if (fscanf(mbfile, "%d", &entry->max_brightness) < 1) {
-    fprintf(stderr, "Couldn't scan max brightness of LED %s\n", name);
-    return 1;
+  entry->max_brightness = max_brightness;
+  if (max_brightness < 0) {
+    path[name_length] = 0;
+    strcat(path, "/max_brightness");
+    FILE *mbfile = fopen(path, "r");
+    if (!mbfile) {
+      fprintf(stderr, "Couldn't open %s for reading\n", path);
+      return 1;
+    }
+    if (fscanf(mbfile, "%d", &entry->max_brightness) < 1) {
+      fprintf(stderr, "Couldn't scan max brightness of LED %s\n", name);
+      return 1;
+    }
+    fclose(mbfile);
   }
+  entry->on_line_length = sprintf(entry->on_line, "%d\n", entry->max_brightness);
 
   // Open control file
   path[name_length] = 0;
@@ -71,54 +165,155 @@ int process_led(server_data *data, const char *name) {
   return 0;
 }
 
+/**
+ * Serve the LEDs listed in a cache file. Returns -1 if it can't be read
+ * (and nothing was opened), and 1 if some LED couldn't be opened.
+ **/
+int process_cache(server_data *data, const char *cache) {
+  FILE *file = fopen(cache, "r");
+  if (!file) return -1;
+
+  char name [MAX_NAME_LENGTH + 1];
+  int max_brightness, status = 0;
+  while (!status && fscanf(file, "%255s %d", name, &max_brightness) == 2)
+    status = process_led(data, name, max_brightness);
+  fclose(file);
+  if (status)
+    fprintf(stderr, "Cache file %s is out of date, remove it to scan again\n", cache);
+  if (!status && !data->entries_found) {
+    fprintf(stderr, "No LEDs in cache file %s\n", cache);
+    return 1;
+  }
+  return status;
+}
+
+/**
+ * Serve all LEDs in the directory, in alphabetical order.
+ **/
+int process_directory(server_data *data) {
+  struct dirent **lednames;
+  int status = scandir(".", &lednames, NULL, alphasort);
+  if (status < 0) {
+    fprintf(stderr, "Failed to scan /sys/class/leds for LEDs\n");
+    return 1;
+  }
+
+  int led, lednames_count = status;
+  status = 0;
+  for (led = 0; led < lednames_count; led++) {
+    if (!status && strcmp(lednames[led]->d_name, ".") != 0 && strcmp(lednames[led]->d_name, "..") != 0)
+      status = process_led(data, lednames[led]->d_name, -1);
+    free(lednames[led]);
+  }
+  free(lednames);
+  return status;
+}
+
+/**
+ * Write the served LEDs to a cache file. Errors are only reported.
+ **/
+void write_cache(const server_data *data, const char *cache) {
+  FILE *file = fopen(cache, "w");
+  size_t led;
+  if (!file) {
+    fprintf(stderr, "Couldn't write cache file %s\n", cache);
+    return;
+  }
+  for (led = 0; led < data->entries_count; led++)
+    fprintf(file, "%s %d\n", data->entries[led].name, data->entries[led].max_brightness);
+  fclose(file);
+}
+
+int print_help(const char *basename) {
+  fprintf(stderr, "Usage: %s [-c <cache file>] [-w <workers>] [<led>...]\n", basename);
+  return 1;
+}
+
 int main(int argc, char **argv) {
   int status;
   server_data data;
+  char cache_path [PATH_MAX];
+  const char *cache = NULL;
+  int workers = 0;
+
+  // Parse args: the options, then the LEDs to serve
+  int arg = 1;
+  while (arg < argc && argv[arg][0] == '-') {
+    if (arg + 1 >= argc) return print_help(argv[0]);
+    if (!strcmp(argv[arg], "-c")) {
+      cache = argv[arg + 1];
+    } else if (!strcmp(argv[arg], "-w")) {
+      workers = atoi(argv[arg + 1]);
+      if (workers <= 0 || workers > MAX_WRITER_THREADS) return print_help(argv[0]);
+    } else {
+      return print_help(argv[0]);
+    }
+    arg += 2;
+  }
+
+  // The cache is used from /sys/class/leds, make its path absolute
+  if (cache && cache[0] != '/') {
+    if (!getcwd(cache_path, sizeof(cache_path)) ||
+        strlen(cache_path) + strlen(cache) + 2 > sizeof(cache_path)) {
+      fprintf(stderr, "Couldn't find the path of the cache file.\n");
+      return 1;
+    }
+    strcat(cache_path, "/");
+    strcat(cache_path, cache);
+    cache = cache_path;
+  }
 
-  // List available LEDs
-  size_t lednames_count;
-  struct dirent **lednames;
   status = chdir("/sys/class/leds");
   if (status) {
     fprintf(stderr, "Couldn't enter /sys/class/leds directory.\n");
     return 1;
   }
-  status = scandir(".", &lednames, NULL, alphasort);
-  if (status < 0) {
-    fprintf(stderr, "Failed to scan /sys/class/leds for LEDs\n");
-    return 1;
-  }
-  lednames_count = status;
 
   // Prepare data structure
   data.entries_count = data.entries_found = 0;
-  data.entries = calloc(lednames_count, sizeof(led_entry));
+  memset(data.state, 0x00, sizeof(data.state));
+  memset(data.known, 0x00, sizeof(data.known));
+  memset(data.partial, 0x00, sizeof(data.partial));
+  data.entries = calloc(MAX_LEDS, sizeof(led_entry));
   if (!data.entries) {
     fprintf(stderr, "Couldn't allocate space for LED entries\n");
     return 1;
   }
 
-  // Process each LED, collect info and open control file
-  size_t led;
-  for (led = 0; led < lednames_count; led++) {
-    if (strcmp(lednames[led]->d_name, ".") == 0 || strcmp(lednames[led]->d_name, "..") == 0)
-      continue;
-    status = process_led(&data, lednames[led]->d_name);
-    if (status) return 1;
-
-    free(lednames[led]);
+  // Open the LEDs given, the cached ones, or all of them
+  if (arg < argc) {
+    for (; arg < argc; arg++)
+      if (process_led(&data, argv[arg], -1)) return 1;
+  } else {
+    status = cache ? process_cache(&data, cache) : -1;
+    if (status > 0) return 1;
+    if (status < 0) {
+      if (process_directory(&data)) return 1;
+      if (cache) write_cache(&data, cache);
+    }
   }
-  free(lednames);
 
   if (data.entries_found > data.entries_count)
     fprintf(stderr, "Warning: %u LEDs found. Serving the first %u.\n", data.entries_found, data.entries_count);
   printf("Serving %u LEDs.\n", data.entries_count);
+  size_t led;
+  for (led = 0; led < data.entries_count; led++)
+    printf("  %d: %s\n", (int) led, data.names[led]);
+  set_ledp_led_names(data.names, data.entries_count);
+
+  if (led_writer_init(&data.writer, workers)) {
+    fprintf(stderr, "Couldn't start the LED writer\n");
+    return 1;
+  }
+  if (workers)
+    printf("Writing LEDs with %s.\n", led_writer_name(&data.writer));
 
   // Start LEDP server
   status = start_ledp_server(DEFAULT_PORT_STRING, handle_message, &data);
   if (status) return 1;
 
   // Close files
+  led_writer_close(&data.writer);
   while (data.entries_count) {
     led_entry *entry = &data.entries[--data.entries_count];
     status = close(entry->brightness_fd);
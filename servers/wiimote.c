@@ -1,35 +1,86 @@
 /**
  * Server that connects to a wiimote and controls its 4 LEDs.
  * You need a bluetooth adapter and libcwiid1 installed to use this.
- * cc wiimote.c -Wall -Wextra -lcwiid -lbluetooth -o wiimote
+ * cc wiimote.c -Wall -Wextra -lcwiid -lbluetooth -lpthread -o wiimote
+ *
+ * Sending a command to the Wiimote is a Bluetooth round trip, so it's
+ * done in a separate thread: the UDP loop only updates the wanted state,
+ * and the updater thread pushes it to the Wiimote when it changes, at
+ * most `rate` times per second. Intermediate states are skipped, so the
+ * LEDs never fall behind the audio.
+ *
+ * The stats are only touched by the UDP loop: the updater records the
+ * LEDs it wrote, and the next packet counts them.
  **/
 
+#include "server.h"
+#include <pthread.h>
 #include <cwiid.h>
 #include <bluetooth/bluetooth.h>
-#include "server.h"
+
+#define DEFAULT_RATE 50
 
 typedef struct server_data {
   cwiid_wiimote_t *wiimote;
+  unsigned interval_us;
+
+  // Protects `leds`, `applied` and `written`
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
   int leds;
+  int applied;
+
+  // Writes of every LED done by the updater, not counted yet
+  unsigned written [4];
 } server_data;
 
 void handle_message(void *opaque, const ledp_packet* packet) {
   server_data *data = opaque;
-  data->leds &= ~packet->mask;
-  data->leds |= packet->values;
+  int i;
+  pthread_mutex_lock(&data->lock);
+  for (i = 0; i < 4; i++)
+    for (; data->written[i]; data->written[i]--)
+      count_ledp_writes(0, 1u << i);
+  data->leds &= ~packet->mask[0];
+  data->leds |= packet->values[0];
+  if (data->leds != data->applied)
+    pthread_cond_signal(&data->changed);
+  pthread_mutex_unlock(&data->lock);
+}
 
-  // Update Wiimote LEDs
+void *update_leds(void *opaque) {
+  server_data *data = opaque;
   static int led_flags [] = { CWIID_LED1_ON, CWIID_LED2_ON, CWIID_LED3_ON, CWIID_LED4_ON };
-  int flags = 0, i;
-  for (i = 0; i < 4; i++)
-    if (data->leds & (1 << i))
-      flags |= led_flags[i];
-  if (cwiid_set_led(data->wiimote, flags))
-    fprintf(stderr, "Couldn't send command to Wiimote\n");
+
+  while (1) {
+    // Wait until the state changes, take the latest one
+    int i;
+    pthread_mutex_lock(&data->lock);
+    while (data->leds == data->applied)
+      pthread_cond_wait(&data->changed, &data->lock);
+    int changed = (data->applied < 0) ? 0xF : (data->applied ^ data->leds) & 0xF;
+    int leds = data->applied = data->leds;
+    for (i = 0; i < 4; i++)
+      if (changed & (1 << i))
+        data->written[i]++;
+    pthread_mutex_unlock(&data->lock);
+
+    // Update Wiimote LEDs
+    int flags = 0;
+    for (i = 0; i < 4; i++)
+      if (leds & (1 << i))
+        flags |= led_flags[i];
+    if (cwiid_set_led(data->wiimote, flags))
+      fprintf(stderr, "Couldn't send command to Wiimote\n");
+
+    // Bound the update rate
+    usleep(data->interval_us);
+  }
+  return NULL;
 }
 
 int print_help(const char *basename) {
-  fprintf(stderr, "Usage: %s [<bdaddr> [<port>]]\n", basename);
+  fprintf(stderr, "Usage: %s [<bdaddr> [<port> [<rate>]]]\n", basename);
   return 1;
 }
 
@@ -37,11 +88,14 @@ int main(int argc, char **argv) {
   server_data data;
   bdaddr_t addr = *BDADDR_ANY;
   const char *port = DEFAULT_PORT_STRING;
+  int rate = DEFAULT_RATE;
   char addr_string [18];
+  pthread_t updater;
+  sigset_t signals, old_signals;
   int status;
 
   // Parse args
-  if (argc > 3) return print_help(argv[0]);
+  if (argc > 4) return print_help(argv[0]);
   if (argc >= 2) {
     if (str2ba(argv[1], &addr)) return print_help(argv[0]);
   }
@@ -50,6 +104,10 @@ int main(int argc, char **argv) {
     if (t <= 0 || t >= 65536) return print_help(argv[0]);
     port = argv[2];
   }
+  if (argc >= 4) {
+    rate = atoi(argv[3]);
+    if (rate <= 0 || rate > 1000) return print_help(argv[0]);
+  }
 
   // Connect to the Wiimote
   printf("Connecting to Wiimote...\n");
@@ -62,8 +120,28 @@ int main(int argc, char **argv) {
   assert(status);
   printf("Connected to %s\n", addr_string);
 
-  // Start LEDP server
+  // Start LED updater
+  data.interval_us = 1000000 / rate;
   data.leds = 0;
+  data.applied = -1;
+  memset(data.written, 0x00, sizeof(data.written));
+  status = pthread_mutex_init(&data.lock, NULL);
+  assert(!status);
+  status = pthread_cond_init(&data.changed, NULL);
+  assert(!status);
+
+  // Only the UDP loop takes SIGUSR1, so the dump doesn't wait for a packet
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  status = pthread_create(&updater, NULL, update_leds, &data);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  if (status) {
+    fprintf(stderr, "Couldn't start LED updater thread\n");
+    return 1;
+  }
+
+  // Start LEDP server
   status = start_ledp_server(port, handle_message, &data);
   if (status) return 1;
 
@@ -0,0 +1,379 @@
+/**
+ * Batched file writer, for servers whose LEDs are slow to write (i.e.
+ * sysfs LEDs behind an I2C expander, where every write blocks on the bus).
+ * The writes for a packet are queued, then submitted together and waited
+ * for, so that applying a packet takes as long as the slowest write instead
+ * of the sum of all of them.
+ *
+ * Writes go through io_uring where the kernel (and the headers) have it,
+ * which runs the blocking ones in its own workers. It's used through the
+ * raw syscalls, so no liburing is needed. Otherwise, they go through a
+ * small pool of threads. A writer with no workers writes right away, one
+ * after another.
+ *
+ * Build with `-lpthread`, and with `-DNO_IO_URING` to leave io_uring out.
+ **/
+
+#ifndef SERVERS_WRITER_H
+#define SERVERS_WRITER_H
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <sys/syscall.h>
+
+// io_uring needs the syscalls, and headers with the single mmap (5.4+),
+// otherwise the thread pool is used
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_SINGLE_MMAP)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#endif
+
+#define MAX_QUEUED_WRITES 512
+#define MAX_WRITER_THREADS 16
+
+#define WRITER_SERIAL 0
+#define WRITER_IO_URING 1
+#define WRITER_THREADS 2
+
+typedef struct led_write {
+  int fd;
+  const char *data;
+  size_t length;
+} led_write;
+
+#ifdef HAVE_IO_URING
+typedef struct writer_ring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  struct iovec iovecs [MAX_QUEUED_WRITES];
+} writer_ring;
+#endif
+
+typedef struct writer_pool {
+  pthread_t threads [MAX_WRITER_THREADS];
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+
+  // Batch being written: its number of writes (workers only read
+  // this, never the count of the writer), the next write to take,
+  // the writes finished, and a number that changes with every batch
+  size_t total, next, finished;
+  unsigned batch;
+  int stop;
+} writer_pool;
+
+typedef struct led_writer {
+  int mode;
+  led_write writes [MAX_QUEUED_WRITES];
+  size_t count;
+#ifdef HAVE_IO_URING
+  writer_ring ring;
+#endif
+  writer_pool pool;
+} led_writer;
+
+static void __write_fully(const led_write *write_data) {
+  ssize_t written = write(write_data->fd, write_data->data, write_data->length);
+  assert(written == (ssize_t) write_data->length);
+  (void) written;
+}
+
+
+// io_uring
+
+#ifdef HAVE_IO_URING
+static int __ring_enter(writer_ring *ring, unsigned submit, unsigned wait) {
+  return syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void __ring_close(writer_ring *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+/**
+ * Create the ring, with room for a batch of `MAX_QUEUED_WRITES`. If
+ * `workers` is given, the kernel runs at most that many blocking writes
+ * at once. Returns non-zero if the kernel doesn't have io_uring.
+ **/
+static int __ring_init(writer_ring *ring, int workers) {
+  struct io_uring_params params;
+  memset(ring, 0x00, sizeof(*ring));
+  memset(&params, 0x00, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, MAX_QUEUED_WRITES, &params);
+  if (ring->fd < 0) return 1;
+
+  // Map the submission and completion rings (maybe in a single mapping),
+  // and the submission entries
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap && ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    __ring_close(ring);
+    return 1;
+  }
+  ring->cq_ring = ring->sq_ring;
+  if (!single_mmap) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      __ring_close(ring);
+      return 1;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    __ring_close(ring);
+    return 1;
+  }
+
+  char *sq = ring->sq_ring, *cq = ring->cq_ring;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+#if defined(IORING_REGISTER_IOWQ_MAX_WORKERS) && defined(__NR_io_uring_register)
+  // Bound the workers for blocking writes (older kernels just refuse)
+  if (workers > 0) {
+    unsigned limits [2] = { workers, workers };
+    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_IOWQ_MAX_WORKERS, limits, 2);
+  }
+#else
+  (void) workers;
+#endif
+  return 0;
+}
+
+/**
+ * Submit the queued writes and wait for all of them. Writes are vectored
+ * (IORING_OP_WRITEV), which even the first kernels with io_uring have.
+ **/
+static void __ring_write(writer_ring *ring, const led_write *writes, size_t count) {
+  unsigned tail = *ring->sq_tail, mask = *ring->sq_mask;
+  size_t i;
+  for (i = 0; i < count; i++, tail++) {
+    unsigned index = tail & mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->iovecs[i].iov_base = (void *) writes[i].data;
+    ring->iovecs[i].iov_len = writes[i].length;
+    memset(sqe, 0x00, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = writes[i].fd;
+    sqe->addr = (unsigned long) &ring->iovecs[i];
+    sqe->len = 1;
+    // Written at offset 0 (like sysfs attributes always are)
+    sqe->user_data = i;
+    ring->sq_array[index] = index;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  // Submit them all (waiting for the completions in the same call),
+  // then reap the completions as they come
+  size_t submitted = 0, completed = 0;
+  while (submitted < count) {
+    int status = __ring_enter(ring, count - submitted, count - submitted);
+    if (status < 0 && errno == EINTR) continue;
+    assert(status > 0);
+    submitted += status;
+  }
+  unsigned head = *ring->cq_head;
+  while (completed < count) {
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      __ring_enter(ring, 0, 1);
+      continue;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    assert(cqe->res == (int) writes[cqe->user_data].length);
+    head++;
+    completed++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+
+// Thread pool
+
+/**
+ * Worker of the pool: waits for a batch, then takes writes from it
+ * until there are none left.
+ **/
+static void *__pool_worker(void *opaque) {
+  led_writer *writer = opaque;
+  writer_pool *pool = &writer->pool;
+  unsigned batch = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->stop && pool->batch == batch)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->stop) break;
+    batch = pool->batch;
+
+    while (pool->next < pool->total) {
+      const led_write *write_data = &writer->writes[pool->next++];
+      pthread_mutex_unlock(&pool->lock);
+      __write_fully(write_data);
+      pthread_mutex_lock(&pool->lock);
+      if (++pool->finished == pool->total)
+        pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void __pool_close(writer_pool *pool) {
+  int i;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->count; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+static int __pool_init(led_writer *writer, int workers) {
+  writer_pool *pool = &writer->pool;
+  memset(pool, 0x00, sizeof(*pool));
+  if (workers > MAX_WRITER_THREADS) workers = MAX_WRITER_THREADS;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (pool->count = 0; pool->count < workers; pool->count++)
+    if (pthread_create(&pool->threads[pool->count], NULL, __pool_worker, writer)) {
+      __pool_close(pool);
+      return 1;
+    }
+  return 0;
+}
+
+static void __pool_write(led_writer *writer) {
+  writer_pool *pool = &writer->pool;
+  pthread_mutex_lock(&pool->lock);
+  pool->total = writer->count;
+  pool->next = pool->finished = 0;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->start);
+  while (pool->finished < pool->total)
+    pthread_cond_wait(&pool->done, &pool->lock);
+
+  // Workers woken late must not take writes until the next batch
+  pool->total = 0;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Writer
+
+/**
+ * Initialize a writer. With `workers` (at most that many writes run at
+ * once), writes are batched, through io_uring if possible. With none,
+ * they're done right away. Returns non-zero on error.
+ **/
+static int led_writer_init(led_writer *writer, int workers) {
+  writer->count = 0;
+  writer->mode = WRITER_SERIAL;
+  if (workers <= 0) return 0;
+#ifdef HAVE_IO_URING
+  if (!__ring_init(&writer->ring, workers)) {
+    writer->mode = WRITER_IO_URING;
+    return 0;
+  }
+#endif
+  if (__pool_init(writer, workers)) return 1;
+  writer->mode = WRITER_THREADS;
+  return 0;
+}
+
+static const char *led_writer_name(const led_writer *writer) {
+  if (writer->mode == WRITER_IO_URING) return "io_uring";
+  if (writer->mode == WRITER_THREADS) return "worker threads";
+  return "serial writes";
+}
+
+/**
+ * Queue a write of `length` bytes of `data` to `fd`. `data` has to stay
+ * valid until the next `led_writer_flush`. Serial writers write it now.
+ **/
+static void led_writer_flush(led_writer *writer);
+
+static inline void led_writer_add(led_writer *writer, int fd, const char *data, size_t length) {
+  if (writer->count == MAX_QUEUED_WRITES)
+    led_writer_flush(writer);
+  led_write *write_data = &writer->writes[writer->count];
+  write_data->fd = fd;
+  write_data->data = data;
+  write_data->length = length;
+  if (writer->mode == WRITER_SERIAL)
+    __write_fully(write_data);
+  else
+    writer->count++;
+}
+
+/**
+ * Do the queued writes, returning when all of them are done.
+ **/
+static void led_writer_flush(led_writer *writer) {
+  if (writer->count == 1) {
+    // Nothing to gain from batching a single write
+    __write_fully(&writer->writes[0]);
+  } else if (writer->count) {
+#ifdef HAVE_IO_URING
+    if (writer->mode == WRITER_IO_URING)
+      __ring_write(&writer->ring, writer->writes, writer->count);
+#endif
+    if (writer->mode == WRITER_THREADS)
+      __pool_write(writer);
+  }
+  writer->count = 0;
+}
+
+static void led_writer_close(led_writer *writer) {
+#ifdef HAVE_IO_URING
+  if (writer->mode == WRITER_IO_URING)
+    __ring_close(&writer->ring);
+#endif
+  if (writer->mode == WRITER_THREADS)
+    __pool_close(&writer->pool);
+}
+
+#endif
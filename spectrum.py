@@ -0,0 +1,122 @@
+"""
+This module implements the spectrum engine of led-meter. Instead of a
+filter chain per meter, a single windowed FFT of the input is computed
+for every frame, and the level of every meter is the power of its band
+in it. So the cost barely grows with the number of bands (meters).
+"""
+
+import numpy as np
+from filters import AttackReleaseFilter
+
+
+class SpectrumAnalyzer:
+    """
+    Computes the power of many frequency bands of the input, every `hop`
+    samples, from the FFT of the last `size` samples with a Hann window
+    (so consecutive windows overlap when `size` is greater than `hop`).
+
+    Powers are scaled like the ones of `LoudnessFilter`, so that the
+    decibels are comparable (a full-scale sine gives 0.5, or -3 dB),
+    and then smoothed with an attack-release filter for every band.
+
+    Every buffer (history, window, spectrum, band sums) is allocated once.
+    numpy keeps the FFT factors of a size cached between calls, but its
+    output is still a new array for every frame.
+    """
+
+    def __init__(self, sample_rate, size, hop, bands):
+        """
+        Initialize the analyzer, for audio at `sample_rate`. `bands` is a list
+        of band tuples: the start and end frequencies (in Hz, or None for no
+        limit), and the attack and release coefficients for the smoothing
+        (at the frame rate, see `AttackReleaseFilter.get_coefficient()`).
+        """
+        self.size, self.hop = size, hop
+        self.phase = 0
+        self.history = np.zeros(size, 'd')
+        self.frame = np.zeros(size, 'd')
+        self.window = 0.5 - 0.5 * np.cos(2 * np.pi * np.arange(size) / size)
+
+        # A sine covers several bins but its power is in all of them,
+        # this scale turns the sum of a band into the mean power
+        bins = size // 2 + 1
+        self.scale = 2 / (size * float((self.window * self.window).sum()))
+        self.power = np.zeros(bins, 'd')
+        self.imaginary_power = np.zeros(bins, 'd')
+        self.cumulative = np.zeros(bins + 1, 'd')
+
+        # Bins of every band, from `starts` (included) to `ends` (excluded),
+        # so that its sum is the difference of the cumulative power at both
+        to_bin = lambda frequency: frequency * size / float(sample_rate)
+        starts, ends = [], []
+        for band in bands:
+            start = 1 if band[0] is None else min(bins - 1, max(1, int(np.ceil(to_bin(band[0])))))
+            end = bins if band[1] is None else min(bins, int(to_bin(band[1])) + 1)
+            starts.append(start)
+            ends.append(max(end, start + 1))
+        self.starts, self.ends = np.array(starts, 'i'), np.array(ends, 'i')
+        self.upper = np.zeros(len(bands), 'd')
+        self.lower = np.zeros(len(bands), 'd')
+        self.band_power = np.zeros(len(bands), 'd')
+
+        self.attack = np.array([band[2] for band in bands], 'd')
+        self.release = np.array([band[3] for band in bands], 'd')
+        self.levels = np.zeros(len(bands), 'd')
+
+    @staticmethod
+    def get_band(sample_rate, hop, start, end, attack_time, release_time):
+        """
+        Return the band tuple for `__init__()`, from the frequencies and
+        the attack and release times (in seconds) of the smoothing.
+        """
+        frames = lambda time: float(time) * sample_rate / hop
+        return (start, end, AttackReleaseFilter.get_coefficient(frames(attack_time)),
+                AttackReleaseFilter.get_coefficient(frames(release_time)))
+
+    def analyze(self):
+        """
+        Compute the levels of the bands from the current history.
+        """
+        np.multiply(self.history, self.window, out=self.frame)
+        spectrum = np.fft.rfft(self.frame)
+        np.multiply(spectrum.real, spectrum.real, out=self.power)
+        np.multiply(spectrum.imag, spectrum.imag, out=self.imaginary_power)
+        np.add(self.power, self.imaginary_power, out=self.power)
+
+        np.cumsum(self.power, out=self.cumulative[1:])
+        np.take(self.cumulative, self.ends, out=self.upper)
+        np.take(self.cumulative, self.starts, out=self.lower)
+        np.subtract(self.upper, self.lower, out=self.band_power)
+        self.band_power *= self.scale
+
+        # Attack-release smoothing, for all bands at once
+        coefficients = np.where(self.band_power > self.levels, self.attack, self.release)
+        self.levels *= coefficients
+        self.levels += (1 - coefficients) * self.band_power
+        return self.levels
+
+    def process_decimated(self, input, interval, levels):
+        """
+        Add the samples of `input` to the history, storing the levels
+        of the bands into a row of `levels` (a 2D array of frames x bands)
+        every `interval` samples, which has to be the hop. `levels` needs
+        room for `len(input) // interval + 1` frames. Returns the number
+        of frames stored.
+        """
+        assert interval == self.hop
+        count = offset = 0
+        length = len(input)
+        while offset < length:
+            chunk = min(self.hop - self.phase, length - offset)
+            if chunk < self.size:
+                self.history[:-chunk] = self.history[chunk:]
+                self.history[-chunk:] = input[offset:offset+chunk]
+            else:
+                self.history[:] = input[offset+chunk-self.size:offset+chunk]
+            offset += chunk
+            self.phase += chunk
+            if self.phase < self.hop: break
+            self.phase = 0
+            levels[count] = self.analyze()
+            count += 1
+        return count
@@ -0,0 +1,208 @@
+#!/usr/bin/python
+"""
+Parameter tuner for led-meter. Runs many meter configurations over the
+same recording, in parallel, and scores how every one of them looks, so
+that good settings for a venue can be found without trying them by ear.
+"""
+
+import imp
+import os
+import math
+import itertools
+import multiprocessing
+import numpy as np
+
+import filters
+import audiofile
+from filters import VolumeFollowFilter, NativeVolumeFollowFilter
+from filters import VolumeFollowBank, NativeVolumeFollowBank
+
+led_meter = imp.load_source("led_meter", os.path.join(os.path.dirname(os.path.abspath(__file__)), "led-meter.py"))
+
+# Most filters a bank can take (see `MAX_BANK_FILTERS` in engine/bank.h)
+max_bank_filters = 64
+
+# Options that change the filter, and options that only change the mapping
+filter_parameters = ["emphasis", "highpass", "attack", "release"]
+map_parameters = ["map-start", "map-end"]
+
+# The decoded audio and the settings shared by all configurations. They are
+# set before the workers are forked, so every worker reads the same memory.
+audio = None
+settings = None
+
+
+# Scoring
+
+def score_counts(counts, count, frame_rate, max_flicker):
+    """
+    Score the LED counts a configuration gives at every frame,
+    for a meter of `count` LEDs. Returns a dictionary with:
+
+    - `activity`: the mean fraction of LEDs lit.
+    - `flicker`: how many times per second the meter reverses direction
+      from one frame to the next (goes up, then down right away, or
+      the opposite), which looks like jitter rather than motion.
+    - `coverage`: how evenly the meter spends time at every count, from
+      0 (always at the same count) to 1 (as long at every count).
+    - `score`: the overall score, higher is better. It's the coverage,
+      lowered as the activity moves away from half of the LEDs and as
+      the flicker goes over `max_flicker` reversals per second.
+    """
+    frames = len(counts)
+    activity = counts.sum() / float(frames * count)
+
+    steps = np.diff(counts)
+    reversals = ((steps[1:] * steps[:-1]) < 0).sum()
+    flicker = reversals * frame_rate / float(frames)
+
+    entropy = 0.0
+    for k in xrange(count + 1):
+        fraction = (counts == k).sum() / float(frames)
+        if fraction > 0: entropy -= fraction * math.log(fraction)
+    coverage = entropy / math.log(count + 1)
+
+    score = coverage * (1 - abs(2 * activity - 1)) / (1 + flicker / max_flicker)
+    return {"activity": activity, "flicker": flicker, "coverage": coverage, "score": score}
+
+
+# Running configurations
+
+def run_configurations(configurations):
+    """
+    Run the filter configurations given (dictionaries with the options of
+    `filter_parameters`) through the shared audio, in a single bank, and
+    score each of them with every map range. Returns a list of results, one
+    for every configuration and map range, with the options and the scores.
+    """
+    sample_rate, interval = settings["sample_rate"], settings["interval"]
+    native = filters.engine is not None
+    filter_class = NativeVolumeFollowFilter if native else VolumeFollowFilter
+    bank_class = NativeVolumeFollowBank if native else VolumeFollowBank
+
+    meter_filters = []
+    for configuration in configurations:
+        meter = dict(settings["defaults"], **configuration)
+        meter_filters.append(led_meter.create_filter(meter, sample_rate, filter_class=filter_class))
+    bank = bank_class(meter_filters)
+
+    # Process the audio block by block (reading it in place), into the
+    # levels of all frames
+    block_size = audiofile.block_size
+    levels = np.zeros((len(audio) // interval + 1, len(configurations)), 'd')
+    block_levels = np.zeros((block_size // interval + 1, len(configurations)), 'd')
+    frames = 0
+    for start in xrange(0, len(audio), block_size):
+        block = audio[start:start+block_size]
+        count = bank.process_decimated([block] * len(configurations), interval, block_levels)
+        levels[frames:frames+count] = block_levels[:count]
+        frames += count
+
+    results = []
+    for f, configuration in enumerate(configurations):
+        for map_range in settings["map_ranges"]:
+            map_options = led_meter.prepare_map_options({"range": map_range, "count": settings["count"],
+                                                         "should_round": settings["round"]})
+            counts = led_meter.map_levels_to_leds(levels[:frames, f], map_options)
+            result = dict(configuration, **dict(zip(map_parameters, map_range)))
+            result.update(score_counts(counts, settings["count"], settings["frame_rate"], settings["max_flicker"]))
+            results.append(result)
+    return results
+
+def split_configurations(configurations, jobs):
+    """
+    Split the configurations in chunks for the workers: at least one
+    chunk per worker, and each of them small enough for a bank.
+    """
+    size = max(1, min(max_bank_filters, -(-len(configurations) // jobs)))
+    return [configurations[i:i+size] for i in xrange(0, len(configurations), size)]
+
+def parse_list(value):
+    """
+    Parse a comma-separated list of numbers.
+    """
+    return [float(item) for item in value.split(",")]
+
+
+
+if __name__ == "__main__":
+    __doc__ = """
+Tuner for led-meter. Runs every combination of the given values of the
+options below over a recording, and prints the best ones. Combinations are
+scored by how evenly they use all LEDs, how close they keep the meter to
+half of the LEDs, and how little they flicker (see `score_counts()`).
+
+Options that aren't varied are taken from the defaults of led-meter.
+
+Usage:
+  tune.py [options] <file>
+  tune.py (-h | --help)
+
+Options:
+  -l <n>, --leds <n>           Number of LEDs of the meter. [default: 8]
+  -f <hz>, --framerate <hz>    Frame rate of the meter. [default: 60]
+  --round                      Round the measure instead of flooring it.
+  -k <list>, --emphasis <list> Emphasis opacities to try. [default: 0,0.36,0.72,0.9]
+  -c <list>, --highpass <list> Highpass cutoffs to try. [default: 0.75,1.5,3]
+  -a <list>, --attack <list>   Attack times to try. [default: 2,10]
+  -r <list>, --release <list>  Release times to try. [default: 40,70,150,300]
+  -s <list>, --map-start <list>  Map starts to try. [default: -30,-24,-18]
+  -e <list>, --map-end <list>  Map ends to try. [default: -8,-4,0]
+  --max-flicker <hz>           Reversals per second over which
+                               the score drops. [default: 4]
+  -n <n>, --top <n>            How many configurations to print. [default: 10]
+  -j <n>, --jobs <n>           Worker processes (defaults to one per core).
+  --raw-format <f>             Read raw samples of this format (s16, s32 or f32)
+                               instead of a WAV file.
+  --raw-rate <hz>              Sample rate of raw input. [default: 48000]
+  --raw-channels <n>           Channels of raw input (the first is used). [default: 1]
+    """
+
+    from docopt import docopt
+    arguments = docopt(__doc__.strip())
+
+    # Decode the whole input once, for all workers
+    audio_input = audiofile.AudioInput(arguments["<file>"], arguments["--raw-format"],
+                                       arguments["--raw-rate"], arguments["--raw-channels"])
+    audio = audio_input.read_all()
+    if not len(audio):
+        raise Exception("input has no audio")
+    sample_rate = audio_input.sample_rate
+    frame_rate = float(arguments["--framerate"])
+    settings = {
+        "sample_rate": sample_rate,
+        "interval": max(1, int(round(sample_rate / frame_rate))),
+        "frame_rate": frame_rate,
+        "count": int(arguments["--leds"]),
+        "round": arguments["--round"],
+        "max_flicker": float(arguments["--max-flicker"]),
+        "defaults": {"envelope-cutoff": 30},
+        "map_ranges": list(itertools.product(parse_list(arguments["--map-start"]),
+                                             parse_list(arguments["--map-end"]))),
+    }
+
+    # Every combination of the filter options, split between the workers
+    values = [parse_list(arguments["--" + name]) for name in filter_parameters]
+    configurations = [dict(zip(filter_parameters, combination)) for combination in itertools.product(*values)]
+    jobs = int(arguments["--jobs"]) if arguments["--jobs"] else multiprocessing.cpu_count()
+    chunks = split_configurations(configurations, jobs)
+    if jobs > 1:
+        pool = multiprocessing.Pool(jobs)
+        results = sum(pool.map(run_configurations, chunks), [])
+        pool.close()
+    else:
+        results = sum(map(run_configurations, chunks), [])
+
+    # Print the best ones
+    results.sort(key=lambda result: result["score"], reverse=True)
+    columns = filter_parameters + map_parameters
+    print "%s  %7s %8s %8s %8s" % (" ".join("%9s" % name for name in columns),
+        "score", "coverage", "activity", "flicker")
+    for result in results[:int(arguments["--top"])]:
+        print "%s  %7.3f %8.3f %8.3f %8.2f" % (" ".join("%9g" % result[name] for name in columns),
+            result["score"], result["coverage"], result["activity"], result["flicker"])
+
+    best = results[0]
+    print
+    print "Tried %d configurations on %.1fs of audio. Best options:" % (len(results), len(audio) / float(sample_rate))
+    print "  " + " ".join("--%s %g" % (name, best[name]) for name in columns)